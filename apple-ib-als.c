@@ -34,9 +34,11 @@
 #include <linux/iio/trigger_consumer.h>
 #include <linux/iio/triggered_buffer.h>
 #include <linux/iio/trigger.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "apple-ibridge.h"
 
@@ -54,6 +56,22 @@ struct appleals_device {
 	int			cur_sensitivity;
 	int			cur_hysteresis;
 	bool			events_enabled;
+	/*
+	 * Dynamic sensitivity changes are sent from a worker rather than
+	 * from the HID event path; only the most recent target value is
+	 * sent, no matter how often the illuminance crossed a band edge in
+	 * the meantime.
+	 */
+	struct work_struct	sens_work;
+	int			want_sensitivity;
+	/*
+	 * In-kernel oversampling: readings are accumulated and only their
+	 * average is pushed to the iio buffer, reducing consumer wakeups by
+	 * the same factor. A ratio of 1 pushes every reading as-is.
+	 */
+	int			oversampl_ratio;
+	int			oversampl_count;
+	s64			oversampl_sum;
 };
 
 static struct hid_driver appleals_hid_driver;
@@ -125,6 +143,17 @@ static int appleals_compute_sensitivity(int cur_illum, int cur_sens)
 	return appleals_sensitivity_map[i].sensitivity;
 }
 
+#ifdef APPLESPI_BENCH
+#include "applespi_bench.h"
+
+/* hook for the applespi_bench module (see "make bench") */
+int appleals_bench_compute_sensitivity(int cur_illum, int cur_sens)
+{
+	return appleals_compute_sensitivity(cur_illum, cur_sens);
+}
+EXPORT_SYMBOL_GPL(appleals_bench_compute_sensitivity);
+#endif
+
 static int appleals_get_field_value_for_usage(struct hid_field *field,
 					      unsigned int usage)
 {
@@ -207,27 +236,55 @@ static void appleals_update_dyn_sensitivity(struct appleals_device *als_dev,
 					    __s32 value)
 {
 	int new_sens;
-	int rc;
 
 	new_sens = appleals_compute_sensitivity(value,
 						als_dev->cur_sensitivity);
 	if (new_sens != als_dev->cur_sensitivity) {
-		rc = appleals_set_config(als_dev,
-			HID_USAGE_SENSOR_LIGHT_ILLUM |
-			HID_USAGE_SENSOR_DATA_MOD_CHANGE_SENSITIVITY_ABS,
-			new_sens);
-		if (!rc)
-			als_dev->cur_sensitivity = new_sens;
+		WRITE_ONCE(als_dev->want_sensitivity, new_sens);
+		schedule_work(&als_dev->sens_work);
 	}
 }
 
+static void appleals_set_sensitivity_worker(struct work_struct *work)
+{
+	struct appleals_device *als_dev =
+		container_of(work, struct appleals_device, sens_work);
+	int new_sens = READ_ONCE(als_dev->want_sensitivity);
+	int rc;
+
+	if (new_sens == als_dev->cur_sensitivity)
+		return;
+
+	rc = appleals_set_config(als_dev,
+		HID_USAGE_SENSOR_LIGHT_ILLUM |
+		HID_USAGE_SENSOR_DATA_MOD_CHANGE_SENSITIVITY_ABS,
+		new_sens);
+	if (!rc)
+		als_dev->cur_sensitivity = new_sens;
+}
+
 static void appleals_push_new_value(struct appleals_device *als_dev,
 				    __s32 value)
 {
-	__s32 buf[2] = { value, value };
+	__s32 buf[2];
+
+	if (als_dev->oversampl_ratio > 1) {
+		als_dev->oversampl_sum += value;
+		if (++als_dev->oversampl_count < als_dev->oversampl_ratio)
+			goto update_sens;
 
+		value = div_s64(als_dev->oversampl_sum,
+				als_dev->oversampl_count);
+		als_dev->oversampl_sum = 0;
+		als_dev->oversampl_count = 0;
+	}
+
+	buf[0] = value;
+	buf[1] = value;
 	iio_push_to_buffers(als_dev->iio_dev, buf);
 
+update_sens:
+	/* the dynamic sensitivity tracks the raw readings */
 	if (als_dev->cur_hysteresis == APPLEALS_DYN_SENS)
 		appleals_update_dyn_sensitivity(als_dev, value);
 }
@@ -235,20 +292,18 @@ static void appleals_push_new_value(struct appleals_device *als_dev,
 static int appleals_hid_event(struct hid_device *hdev, struct hid_field *field,
 			      struct hid_usage *usage, __s32 value)
 {
-	struct appleals_device *als_dev =
-		appleib_get_drvdata(hid_get_drvdata(hdev),
-				    &appleals_hid_driver);
-	int rc = 0;
+	struct appleals_device *als_dev;
 
-	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_SENSOR)
+	/* the usage includes the page, so this is all the filtering needed */
+	if (usage->hid != HID_USAGE_SENSOR_LIGHT_ILLUM)
 		return 0;
 
-	if (usage->hid == HID_USAGE_SENSOR_LIGHT_ILLUM) {
-		appleals_push_new_value(als_dev, value);
-		rc = 1;
-	}
+	als_dev = appleib_get_drvdata(hid_get_drvdata(hdev),
+				      &appleals_hid_driver);
 
-	return rc;
+	appleals_push_new_value(als_dev, value);
+
+	return 1;
 }
 
 static int appleals_enable_events(struct iio_trigger *trig, bool enable)
@@ -298,6 +353,10 @@ static int appleals_read_raw(struct iio_dev *iio_dev,
 
 		return IIO_VAL_INT_PLUS_MICRO;
 
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		*val = als_dev->oversampl_ratio;
+		return IIO_VAL_INT;
+
 	case IIO_CHAN_INFO_HYSTERESIS:
 		if (als_dev->cur_hysteresis == APPLEALS_DYN_SENS) {
 			*val = als_dev->cur_hysteresis;
@@ -335,6 +394,16 @@ static int appleals_write_raw(struct iio_dev *iio_dev,
 					 1000000000 / (val * 1000000 + val2));
 		return rc;
 
+	case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+		if (val < 1)
+			return -EINVAL;
+
+		als_dev->oversampl_ratio = val;
+		als_dev->oversampl_count = 0;
+		als_dev->oversampl_sum = 0;
+
+		return 0;
+
 	case IIO_CHAN_INFO_HYSTERESIS:
 		if (val == APPLEALS_DYN_SENS) {
 			if (als_dev->cur_hysteresis != APPLEALS_DYN_SENS) {
@@ -370,7 +439,8 @@ static const struct iio_chan_spec appleals_channels[] = {
 		.channel2 = IIO_MOD_LIGHT_BOTH,
 		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
 		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SAMP_FREQ) |
-			BIT(IIO_CHAN_INFO_HYSTERESIS),
+			BIT(IIO_CHAN_INFO_HYSTERESIS) |
+			BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO),
 		.scan_type = {
 			.sign = 'u',
 			.realbits = 32,
@@ -382,7 +452,8 @@ static const struct iio_chan_spec appleals_channels[] = {
 		.type = IIO_LIGHT,
 		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
 		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SAMP_FREQ) |
-			BIT(IIO_CHAN_INFO_HYSTERESIS),
+			BIT(IIO_CHAN_INFO_HYSTERESIS) |
+			BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO),
 		.scan_type = {
 			.sign = 'u',
 			.realbits = 32,
@@ -558,6 +629,7 @@ static int appleals_probe(struct hid_device *hdev,
 
 	als_dev->cur_hysteresis = APPLEALS_DEF_CHANGE_SENS;
 	als_dev->cur_sensitivity = APPLEALS_DEF_CHANGE_SENS;
+	als_dev->want_sensitivity = APPLEALS_DEF_CHANGE_SENS;
 	appleals_config_sensor(als_dev, false, als_dev->cur_sensitivity);
 
 	return appleals_config_iio(als_dev);
@@ -569,6 +641,8 @@ static void appleals_remove(struct hid_device *hdev)
 		appleib_get_drvdata(hid_get_drvdata(hdev),
 				    &appleals_hid_driver);
 
+	cancel_work_sync(&als_dev->sens_work);
+
 	iio_device_unregister(als_dev->iio_dev);
 
 	iio_trigger_unregister(als_dev->iio_trig);
@@ -617,8 +691,11 @@ static int appleals_platform_probe(struct platform_device *pdev)
 
 	als_dev->ib_dev = ib_dev;
 	als_dev->log_dev = ddata->log_dev;
+	als_dev->oversampl_ratio = 1;
+	INIT_WORK(&als_dev->sens_work, appleals_set_sensitivity_worker);
 
-	rc = appleib_register_hid_driver(ib_dev, &appleals_hid_driver, als_dev);
+	rc = appleib_register_hid_driver(ib_dev, &appleals_hid_driver,
+					 als_dev, HID_UP_SENSOR);
 	if (rc)
 		goto error;
 
@@ -28,6 +28,7 @@
 
 #include <linux/device.h>
 #include <linux/hid.h>
+#include <linux/hrtimer.h>
 #include <linux/input.h>
 #include <linux/jiffies.h>
 #include <linux/ktime.h>
@@ -38,6 +39,7 @@
 #include <linux/sysfs.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb.h>
+#include <linux/version.h>
 #include <linux/workqueue.h>
 
 #include "apple-ibridge.h"
@@ -71,6 +73,9 @@
 
 #define APPLETB_MAX_DIM_TIME	30
 
+/* deadline slack within which the dim/idle timeout timer isn't re-armed */
+#define APPLETB_TIMEOUT_SLACK_NS	(100 * NSEC_PER_MSEC)
+
 static int appletb_tb_def_idle_timeout = 5 * 60;
 module_param_named(idle_timeout, appletb_tb_def_idle_timeout, int, 0444);
 MODULE_PARM_DESC(idle_timeout, "Default touch bar idle timeout:\n"
@@ -146,6 +151,7 @@ struct appletb_device {
 	struct input_handle	tpd_handle;
 
 	bool			last_tb_keys_pressed[APPLETB_MAX_TB_KEYS];
+	unsigned int		tb_keys_pressed_cnt;
 	bool			last_tb_keys_translated[APPLETB_MAX_TB_KEYS];
 	bool			last_fn_pressed;
 
@@ -158,6 +164,18 @@ struct appletb_device {
 	bool			tb_autopm_off;
 	bool			restore_autopm;
 	struct delayed_work	tb_work;
+	/*
+	 * Mode/display updates run on their own high-priority workqueue so
+	 * the Fn-key reaction isn't queued behind unrelated system_wq work.
+	 */
+	struct workqueue_struct	*tb_wq;
+	/*
+	 * Timer driving the dim and idle-off timeouts. It is only re-armed
+	 * when the computed deadline moves by more than the slack, so a
+	 * stream of input events doesn't constantly cancel and re-queue it.
+	 */
+	struct hrtimer		tb_timeout_timer;
+	ktime_t			tb_timeout_deadline;
 	/* protects most of the above */
 	spinlock_t		tb_lock;
 
@@ -300,19 +318,39 @@ static int appletb_set_tb_disp(struct appletb_device *tb_dev,
 
 static bool appletb_any_tb_key_pressed(struct appletb_device *tb_dev)
 {
-	int idx;
+	return tb_dev->tb_keys_pressed_cnt != 0;
+}
 
-	for (idx = 0; idx < ARRAY_SIZE(tb_dev->last_tb_keys_pressed); idx++) {
-		if (tb_dev->last_tb_keys_pressed[idx])
-			return true;
-	}
+static void appletb_schedule_tb_update(struct appletb_device *tb_dev, s64 secs)
+{
+	queue_delayed_work(tb_dev->tb_wq, &tb_dev->tb_work,
+			   msecs_to_jiffies(secs * 1000));
+}
 
-	return false;
+static void appletb_schedule_tb_timeout(struct appletb_device *tb_dev, s64 secs)
+{
+	ktime_t deadline = ktime_add_ms(ktime_get(), secs * 1000);
+	s64 delta = ktime_to_ns(ktime_sub(deadline,
+					  tb_dev->tb_timeout_deadline));
+
+	if (hrtimer_active(&tb_dev->tb_timeout_timer) &&
+	    abs(delta) <= APPLETB_TIMEOUT_SLACK_NS)
+		return;
+
+	tb_dev->tb_timeout_deadline = deadline;
+	hrtimer_start_range_ns(&tb_dev->tb_timeout_timer, deadline,
+			       APPLETB_TIMEOUT_SLACK_NS, HRTIMER_MODE_ABS);
 }
 
-static void appletb_schedule_tb_update(struct appletb_device *tb_dev, s64 secs)
+static enum hrtimer_restart appletb_tb_timeout_fn(struct hrtimer *timer)
 {
-	schedule_delayed_work(&tb_dev->tb_work, msecs_to_jiffies(secs * 1000));
+	struct appletb_device *tb_dev =
+		container_of(timer, struct appletb_device, tb_timeout_timer);
+
+	/* the actual timeout handling runs in the worker */
+	queue_delayed_work(tb_dev->tb_wq, &tb_dev->tb_work, 0);
+
+	return HRTIMER_NORESTART;
 }
 
 static void appletb_set_tb_worker(struct work_struct *work)
@@ -335,6 +373,23 @@ static void appletb_set_tb_worker(struct work_struct *work)
 	pending_disp = tb_dev->pnd_tb_disp;
 	restore_autopm = tb_dev->restore_autopm;
 
+	/*
+	 * The cached state is authoritative: don't waste a USB round-trip
+	 * (worst case including EPIPE retries) re-sending a state the device
+	 * is already in, e.g. when a pending change was reverted again
+	 * before we got to run.
+	 */
+	if (pending_mode != APPLETB_CMD_MODE_NONE &&
+	    pending_mode == tb_dev->cur_tb_mode) {
+		tb_dev->pnd_tb_mode = APPLETB_CMD_MODE_NONE;
+		pending_mode = APPLETB_CMD_MODE_NONE;
+	}
+	if (pending_disp != APPLETB_CMD_DISP_NONE &&
+	    pending_disp == tb_dev->cur_tb_disp) {
+		tb_dev->pnd_tb_disp = APPLETB_CMD_DISP_NONE;
+		pending_disp = APPLETB_CMD_DISP_NONE;
+	}
+
 	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 
 	if (pending_mode != APPLETB_CMD_MODE_NONE)
@@ -417,10 +472,10 @@ static void appletb_set_tb_worker(struct work_struct *work)
 	/* manage idle/dim timeout */
 	if (time_left > 0) {
 		/* we fired too soon or had a mode-change - re-schedule */
-		appletb_schedule_tb_update(tb_dev, time_left);
+		appletb_schedule_tb_timeout(tb_dev, time_left);
 	} else if (any_tb_key_pressed) {
 		/* keys are still pressed - re-schedule */
-		appletb_schedule_tb_update(tb_dev, min_timeout);
+		appletb_schedule_tb_timeout(tb_dev, min_timeout);
 	} else {
 		/* dim or idle timeout reached */
 		int next_disp = (time_to_off == 0) ? APPLETB_CMD_DISP_OFF :
@@ -433,7 +488,7 @@ static void appletb_set_tb_worker(struct work_struct *work)
 		}
 
 		if (time_to_off > 0)
-			appletb_schedule_tb_update(tb_dev, time_to_off);
+			appletb_schedule_tb_timeout(tb_dev, time_to_off);
 	}
 }
 
@@ -662,35 +717,50 @@ static ssize_t fnmode_store(struct device *dev, struct device_attribute *attr,
 	return size;
 }
 
+/* direct scancode-to-slot map; covers KEY_ESC and KEY_F1 - KEY_F12 */
+static const s8 appletb_tb_key_slots[KEY_F12 + 1] = {
+	[0 ... KEY_F12]		= -1,
+	[KEY_ESC]		= 0,
+	[KEY_F1]		= 1,
+	[KEY_F2]		= 2,
+	[KEY_F3]		= 3,
+	[KEY_F4]		= 4,
+	[KEY_F5]		= 5,
+	[KEY_F6]		= 6,
+	[KEY_F7]		= 7,
+	[KEY_F8]		= 8,
+	[KEY_F9]		= 9,
+	[KEY_F10]		= 10,
+	[KEY_F11]		= 11,
+	[KEY_F12]		= 12,
+};
+
 static int appletb_tb_key_to_slot(unsigned int code)
 {
-	switch (code) {
-	case KEY_ESC:
-		return 0;
-	case KEY_F1:
-	case KEY_F2:
-	case KEY_F3:
-	case KEY_F4:
-	case KEY_F5:
-	case KEY_F6:
-	case KEY_F7:
-	case KEY_F8:
-	case KEY_F9:
-	case KEY_F10:
-		return code - KEY_F1 + 1;
-	case KEY_F11:
-	case KEY_F12:
-		return code - KEY_F11 + 11;
-	default:
+	if (code > KEY_F12)
 		return -1;
-	}
+
+	return appletb_tb_key_slots[code];
+}
+
+#ifdef APPLESPI_BENCH
+#include "applespi_bench.h"
+
+/* hook for the applespi_bench module (see "make bench") */
+int appletb_bench_key_to_slot(unsigned int code)
+{
+	return appletb_tb_key_to_slot(code);
 }
+EXPORT_SYMBOL_GPL(appletb_bench_key_to_slot);
+#endif
 
 static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
 			     struct hid_usage *usage, __s32 value)
 {
-	struct appletb_device *tb_dev =
-		appleib_get_drvdata(hid_get_drvdata(hdev), &appletb_hid_driver);
+	struct appletb_device *tb_dev;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+	ktime_t event_ts = ktime_get();
+#endif
 	unsigned int new_code = 0;
 	unsigned long flags;
 	bool send_dummy = false;
@@ -714,6 +784,9 @@ static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
 	if (slot < 0)
 		return 0;
 
+	tb_dev = appleib_get_drvdata(hid_get_drvdata(hdev),
+				     &appletb_hid_driver);
+
 	spin_lock_irqsave(&tb_dev->tb_lock, flags);
 
 	if (!tb_dev->active) {
@@ -724,8 +797,10 @@ static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
 	new_code = appletb_fn_to_special(usage->code);
 
 	/* remember which (untranslated) touch bar keys are pressed */
-	if (value != 2)
+	if (value != 2 && tb_dev->last_tb_keys_pressed[slot] != !!value) {
 		tb_dev->last_tb_keys_pressed[slot] = value;
+		tb_dev->tb_keys_pressed_cnt += value ? 1 : -1;
+	}
 
 	/* remember last time keyboard or touchpad was touched */
 	tb_dev->last_event_time = ktime_get();
@@ -767,6 +842,18 @@ static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
 	 *       input_event()                  appletb_inp_event()
 	 *         acquire dev->event_lock        acquire tb_lock
 	 */
+	if (send_dummy || send_trnsl) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+		/*
+		 * Stamp the substituted events with the time the event
+		 * reached us rather than when the input core processes
+		 * them, keeping them in line with the keys the HID core
+		 * reports directly.
+		 */
+		input_set_timestamp(field->hidinput->input, event_ts);
+#endif
+	}
+
 	if (send_dummy) {
 		input_event(field->hidinput->input, EV_KEY, KEY_UNKNOWN, 1);
 		input_event(field->hidinput->input, EV_KEY, KEY_UNKNOWN, 0);
@@ -1087,9 +1174,12 @@ static void appletb_remove(struct hid_device *hdev)
 
 		input_unregister_handler(&tb_dev->inp_handler);
 
+		hrtimer_cancel(&tb_dev->tb_timeout_timer);
 		cancel_delayed_work_sync(&tb_dev->tb_work);
-		appletb_set_tb_mode(tb_dev, APPLETB_CMD_MODE_OFF);
-		appletb_set_tb_disp(tb_dev, APPLETB_CMD_DISP_ON);
+		if (tb_dev->cur_tb_mode != APPLETB_CMD_MODE_OFF)
+			appletb_set_tb_mode(tb_dev, APPLETB_CMD_MODE_OFF);
+		if (tb_dev->cur_tb_disp != APPLETB_CMD_DISP_ON)
+			appletb_set_tb_disp(tb_dev, APPLETB_CMD_DISP_ON);
 
 		if (tb_dev->tb_autopm_off)
 			usb_autopm_put_interface(tb_dev->disp_info.usb_iface);
@@ -1127,6 +1217,7 @@ static int appletb_suspend(struct hid_device *hdev, pm_message_t message)
 
 	if (!tb_dev->mode_info.suspended && !tb_dev->disp_info.suspended) {
 		tb_dev->active = false;
+		hrtimer_cancel(&tb_dev->tb_timeout_timer);
 		cancel_delayed_work(&tb_dev->tb_work);
 	}
 
@@ -1153,8 +1244,10 @@ static int appletb_suspend(struct hid_device *hdev, pm_message_t message)
 	 * special casing between the two).
 	 */
 	if (message.event == PM_EVENT_SUSPEND) {
-		appletb_set_tb_mode(tb_dev, APPLETB_CMD_MODE_OFF);
-		appletb_set_tb_disp(tb_dev, APPLETB_CMD_DISP_OFF);
+		if (tb_dev->cur_tb_mode != APPLETB_CMD_MODE_OFF)
+			appletb_set_tb_mode(tb_dev, APPLETB_CMD_MODE_OFF);
+		if (tb_dev->cur_tb_disp != APPLETB_CMD_DISP_OFF)
+			appletb_set_tb_disp(tb_dev, APPLETB_CMD_DISP_OFF);
 	}
 
 	spin_lock_irqsave(&tb_dev->tb_lock, flags);
@@ -1212,14 +1305,25 @@ static struct appletb_device *appletb_alloc_device(struct device *log_dev)
 	/* initialize structures */
 	spin_lock_init(&tb_dev->tb_lock);
 	INIT_DELAYED_WORK(&tb_dev->tb_work, appletb_set_tb_worker);
+	hrtimer_init(&tb_dev->tb_timeout_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	tb_dev->tb_timeout_timer.function = appletb_tb_timeout_fn;
 	tb_dev->log_dev = log_dev;
 
+	tb_dev->tb_wq = alloc_workqueue("appletb", WQ_HIGHPRI, 0);
+	if (!tb_dev->tb_wq) {
+		kfree(tb_dev);
+		return NULL;
+	}
+
 	return tb_dev;
 }
 
 static void appletb_free_device(struct appletb_device *tb_dev)
 {
+	hrtimer_cancel(&tb_dev->tb_timeout_timer);
 	cancel_delayed_work_sync(&tb_dev->tb_work);
+	destroy_workqueue(tb_dev->tb_wq);
 	kfree(tb_dev);
 }
 
@@ -1246,7 +1350,8 @@ static int appletb_platform_probe(struct platform_device *pdev)
 	if (!tb_dev)
 		return -ENOMEM;
 
-	rc = appleib_register_hid_driver(ib_dev, &appletb_hid_driver, tb_dev);
+	rc = appleib_register_hid_driver(ib_dev, &appletb_hid_driver, tb_dev,
+					 HID_UP_KEYBOARD);
 	if (rc)
 		goto error;
 
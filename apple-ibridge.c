@@ -102,6 +102,8 @@ struct appleib_hid_drv_info {
 	struct list_head	entry;
 	struct hid_driver	*driver;
 	void			*driver_data;
+	/* only forward events from this usage page to the driver; 0 = all */
+	unsigned int		event_usage_page;
 };
 
 struct appleib_hid_dev_info {
@@ -112,12 +114,26 @@ struct appleib_hid_dev_info {
 	bool				started;
 };
 
+/*
+ * The hid_drivers and hid_devices lists are protected by two mechanisms:
+ * readers that may sleep (the probe/input-configured/pm callback forwarding)
+ * hold lists_srcu, while the per-event hot path, which never sleeps, runs
+ * under a plain rcu read-side section so that forwarding input events is
+ * wait-free. Writers therefore have to synchronize against both reader
+ * types after unlinking an entry.
+ */
+static void appleib_sync_list_readers(struct appleib_device *ib_dev)
+{
+	synchronize_srcu(&ib_dev->lists_srcu);
+	synchronize_rcu();
+}
+
 static void appleib_remove_driver(struct appleib_device *ib_dev,
 				  struct appleib_hid_drv_info *drv_info,
 				  struct appleib_hid_dev_info *dev_info)
 {
 	list_del_rcu(&drv_info->entry);
-	synchronize_srcu(&ib_dev->lists_srcu);
+	appleib_sync_list_readers(ib_dev);
 
 	if (drv_info->driver->remove)
 		drv_info->driver->remove(dev_info->device);
@@ -182,7 +198,7 @@ static void appleib_remove_device(struct appleib_device *ib_dev,
 				  struct appleib_hid_dev_info *dev_info)
 {
 	list_del_rcu(&dev_info->entry);
-	synchronize_srcu(&ib_dev->lists_srcu);
+	appleib_sync_list_readers(ib_dev);
 
 	appleib_remove_driver_attachments(ib_dev, dev_info, NULL);
 
@@ -194,7 +210,7 @@ void appleib_detach_and_free_hid_driver(struct appleib_device *ib_dev,
 {
 	appleib_detach_devices(ib_dev, drv_info->driver);
 	list_del_rcu(&drv_info->entry);
-	synchronize_srcu(&ib_dev->lists_srcu);
+	appleib_sync_list_readers(ib_dev);
 	kfree(drv_info);
 }
 
@@ -273,11 +289,17 @@ static void appleib_stop_hid_events(struct appleib_hid_dev_info *dev_info)
  * @driver: the driver to register
  * @data: the driver-data to associate with the driver; this is available
  *        from appleib_get_drvdata().
+ * @event_usage_page: if non-zero, input events are forwarded to this driver
+ *        only when their usage belongs to the given HID usage page. Since all
+ *        the iBridge functions are multiplexed through a single USB device,
+ *        this is what keeps e.g. ALS readings from being offered to the touch
+ *        bar driver (and vice versa) on every event.
  *
  * Return: 0 on success or -errno
  */
 int appleib_register_hid_driver(struct appleib_device *ib_dev,
-				struct hid_driver *driver, void *data)
+				struct hid_driver *driver, void *data,
+				unsigned int event_usage_page)
 {
 	struct appleib_hid_drv_info *drv_info;
 	struct appleib_hid_dev_info *dev_info;
@@ -293,6 +315,7 @@ int appleib_register_hid_driver(struct appleib_device *ib_dev,
 
 	drv_info->driver = driver;
 	drv_info->driver_data = data;
+	drv_info->event_usage_page = event_usage_page;
 
 	mutex_lock(&ib_dev->update_lock);
 
@@ -391,35 +414,47 @@ static int appleib_forward_int_op(struct hid_device *hdev,
 	return rc;
 }
 
-struct appleib_hid_event_args {
-	struct hid_field *field;
-	struct hid_usage *usage;
-	__s32 value;
-};
-
-static int appleib_hid_event_fwd(struct appleib_hid_drv_info *drv_info,
-				 struct hid_device *hdev, void *args)
+static int appleib_hid_event(struct hid_device *hdev, struct hid_field *field,
+			     struct hid_usage *usage, __s32 value)
 {
-	struct appleib_hid_event_args *evt_args = args;
+	struct appleib_device *ib_dev = hid_get_drvdata(hdev);
+	struct appleib_hid_dev_info *dev_info;
+	struct appleib_hid_drv_info *drv_info;
 	int rc = 0;
 
-	if (drv_info->driver->event)
-		rc = drv_info->driver->event(hdev, evt_args->field,
-					     evt_args->usage, evt_args->value);
+	/*
+	 * This is the hot path for every touch bar touch and ALS reading
+	 * multiplexed through the iBridge; unlike the other forwarded
+	 * callbacks neither we nor the sub-drivers' event handlers may
+	 * sleep here, so a plain rcu read-side section suffices and no
+	 * (srcu) locks or barriers are incurred per event.
+	 */
+	rcu_read_lock();
 
-	return rc;
-}
+	list_for_each_entry_rcu(dev_info, &ib_dev->hid_devices, entry) {
+		if (dev_info->device != hdev)
+			continue;
 
-static int appleib_hid_event(struct hid_device *hdev, struct hid_field *field,
-			     struct hid_usage *usage, __s32 value)
-{
-	struct appleib_hid_event_args args = {
-		.field = field,
-		.usage = usage,
-		.value = value,
-	};
+		list_for_each_entry_rcu(drv_info, &dev_info->drivers, entry) {
+			if (drv_info->event_usage_page &&
+			    (usage->hid & HID_USAGE_PAGE) !=
+			    drv_info->event_usage_page)
+				continue;
 
-	return appleib_forward_int_op(hdev, appleib_hid_event_fwd, &args);
+			if (drv_info->driver->event) {
+				rc = drv_info->driver->event(hdev, field,
+							     usage, value);
+				if (rc)
+					break;
+			}
+		}
+
+		break;
+	}
+
+	rcu_read_unlock();
+
+	return rc;
 }
 
 static __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
@@ -430,12 +465,19 @@ static __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 	 * bytes in a report"). Furthermore, hid_field_extract() complains
 	 * when encountering such a field. So turn them into two 32-bit fields
 	 * instead.
+	 *
+	 * Only the touch bar interface has this descriptor, so everything
+	 * else (e.g. the ALS interface, and re-parses on reset-resume where
+	 * the descriptor was already patched in place) bails out on the
+	 * common checks up front instead of evaluating both field matches.
 	 */
 
-	if (*rsize == 634 &&
+	if (*rsize != 634 ||
 	    /* Usage Page 0xff12 (vendor defined) */
-	    rdesc[212] == 0x06 && rdesc[213] == 0x12 && rdesc[214] == 0xff &&
-	    /* Usage 0x51 */
+	    rdesc[212] != 0x06 || rdesc[213] != 0x12 || rdesc[214] != 0xff)
+		return rdesc;
+
+	if (/* Usage 0x51 */
 	    rdesc[416] == 0x09 && rdesc[417] == 0x51 &&
 	    /* report size 64 */
 	    rdesc[432] == 0x75 && rdesc[433] == 64 &&
@@ -446,10 +488,7 @@ static __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 		hid_dbg(hdev, "Fixed up first 64-bit field\n");
 	}
 
-	if (*rsize == 634 &&
-	    /* Usage Page 0xff12 (vendor defined) */
-	    rdesc[212] == 0x06 && rdesc[213] == 0x12 && rdesc[214] == 0xff &&
-	    /* Usage 0x51 */
+	if (/* Usage 0x51 */
 	    rdesc[611] == 0x09 && rdesc[612] == 0x51 &&
 	    /* report size 64 */
 	    rdesc[627] == 0x75 && rdesc[628] == 64 &&
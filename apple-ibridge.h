@@ -22,7 +22,8 @@ struct appleib_device_data {
 };
 
 int appleib_register_hid_driver(struct appleib_device *ib_dev,
-				struct hid_driver *driver, void *data);
+				struct hid_driver *driver, void *data,
+				unsigned int event_usage_page);
 int appleib_unregister_hid_driver(struct appleib_device *ib_dev,
 				  struct hid_driver *driver);
 
@@ -42,24 +42,39 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/completion.h>
 #include <linux/crc16.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/dma-mapping.h>
 #include <linux/efi.h>
+#include <linux/hrtimer.h>
 #include <linux/input.h>
 #include <linux/input/mt.h>
 #include <linux/jiffies.h>
+#include <linux/kthread.h>
 #include <linux/ktime.h>
 #include <linux/leds.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/spinlock.h>
 #include <linux/spi/spi.h>
 #include <linux/string.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/trace_events.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+#include <uapi/linux/sched/types.h>
+#endif
+
 #include <asm/barrier.h>
 #include <asm/unaligned.h>
 
@@ -90,6 +105,13 @@
 #define APPLESPI_PACKET_SIZE	256
 #define APPLESPI_STATUS_SIZE	4
 
+/*
+ * Need room for MAX_MSG_FRAGS retained fragment buffers plus one being read
+ * into plus the ring's always-empty slot.
+ */
+#define APPLESPI_RX_RING_MIN	(MAX_MSG_FRAGS + 2)
+#define APPLESPI_RX_RING_MAX	16
+
 #define PACKET_TYPE_READ	0x20
 #define PACKET_TYPE_WRITE	0x40
 #define PACKET_DEV_KEYB		0x01
@@ -101,6 +123,42 @@
 #define MAX_FINGERS		11
 #define MAX_FINGER_ORIENTATION	16384
 #define MAX_PKTS_PER_MSG	2
+/*
+ * A message is at most MAX_PKTS_PER_MSG * APPLESPI_PACKET_SIZE (512) bytes,
+ * while each packet carries up to 246 bytes of payload; so a message can be
+ * fragmented over at most 3 packets.
+ */
+#define MAX_MSG_FRAGS		3
+
+/* max packets in a debugfs-injected replay stream */
+#define MAX_INJECT_PKTS		64
+
+/* stages of the hardware-to-input latency histograms */
+enum applespi_lat_stage {
+	LAT_IRQ_TO_COMPL,	/* GPE entry to spi completion */
+	LAT_COMPL_TO_INPUT,	/* spi completion to input_sync */
+	LAT_IRQ_TO_INPUT,	/* GPE entry to input_sync */
+	LAT_NUM_STAGES
+};
+
+enum applespi_lat_dev {
+	LAT_DEV_KEYB,
+	LAT_DEV_TPAD,
+	LAT_NUM_DEVS
+};
+
+/* log2(µs) buckets; the last one collects everything >= 2^24 µs */
+#define LAT_NBUCKETS		26
+
+/* slots in the mmap-able raw packet capture ring */
+#define CAPTURE_NSLOTS		256
+/* the slots start at this offset into the capture buffer, after the header */
+#define CAPTURE_DATA_OFF	PAGE_SIZE
+
+/* slots in the mmap-able raw touchpad frame ring */
+#define TP_FRAMES_NSLOTS	128
+/* the slots start at this offset into the frame buffer, after the header */
+#define TP_FRAMES_DATA_OFF	PAGE_SIZE
 
 #define KBD_BL_LEVEL_MIN	32U
 #define KBD_BL_LEVEL_MAX	255U
@@ -108,6 +166,8 @@
 #define KBD_BL_LEVEL_ADJ	\
 	((KBD_BL_LEVEL_MAX - KBD_BL_LEVEL_MIN) * KBD_BL_LEVEL_SCALE / 255U)
 
+#define BL_SAVE_DELAY_MS	5000	/* debounce for persisting bl level */
+
 #define EFI_BL_LEVEL_NAME	L"KeyboardBacklightLevel"
 #define EFI_BL_LEVEL_GUID	EFI_GUID(0xa076d2af, 0x9678, 0x4386, 0x8b, 0x58, 0x1f, 0xc8, 0xef, 0x04, 0x16, 0x19)
 
@@ -115,6 +175,14 @@
 
 #define SPI_RW_CHG_DELAY_US	100	/* from experimentation, in µs */
 
+/* bits in applespi_data.cmd_pending, in descending priority */
+enum applespi_cmd {
+	CMD_TP_INFO,
+	CMD_MT_INIT,
+	CMD_CL_LED,
+	CMD_BL_LEVEL,
+};
+
 #define SYNAPTICS_VENDOR_ID	0x06cb
 
 static unsigned int fnmode = 1;
@@ -138,6 +206,10 @@ static char* trace_event;
 module_param(trace_event, charp, 0444);
 MODULE_PARM_DESC(trace_event, "Enable early event tracing. It takes the form of a comma-separated list of events to enable.");
 
+static unsigned int rx_ring_depth = 8;
+module_param(rx_ring_depth, uint, 0444);
+MODULE_PARM_DESC(rx_ring_depth, "Number of preallocated SPI RX buffers ([8]; min 5, max 16). With more than one buffer the next SPI read can be started while the previous packet is still being parsed.");
+
 /**
  * struct keyboard_protocol - keyboard message.
  * message.type = 0x0110, message.length = 0x000a
@@ -249,6 +321,21 @@ struct touchpad_info_protocol {
 	__le16			crc16;
 };
 
+/*
+ * The touchpad model can't change while the machine is up, so the info
+ * response is cached across rebinds of the driver and only queried on the
+ * very first probe.
+ */
+static struct touchpad_info_protocol applespi_saved_tp_info;
+static bool applespi_have_tp_info;
+
+/*
+ * When the driver first started coming up, for measuring the time from
+ * insmod to the first keystroke reaching the input layer; exposed via
+ * debugfs so boot-time (LUKS passphrase prompt) latency can be tracked.
+ */
+static ktime_t applespi_start_ts;
+
 /**
  * struct command_protocol_mt_init - initialize multitouch.
  * message.type = 0x0252, message.length = 0x0002
@@ -385,6 +472,45 @@ struct spi_settings {
 	u64	reset_rec_usec;		/* ? (cur val: 10) */
 };
 
+/*
+ * Layout of the mmap-able raw packet capture buffer exposed via debugfs.
+ * The header lives at offset 0, the slot array at CAPTURE_DATA_OFF. @head
+ * is free-running; the slot written last is (head - 1) % nslots. Userspace
+ * must read a slot's contents before and after reading @head and discard
+ * torn records.
+ */
+struct applespi_capture_hdr {
+	u32	nslots;
+	u32	slot_size;
+	u64	head;
+};
+
+struct applespi_capture_slot {
+	u64	ts_ns;
+	u32	len;
+	u32	pad;
+	u8	data[APPLESPI_PACKET_SIZE];
+};
+
+/*
+ * Raw touchpad frame stream for userspace gesture engines; same layout
+ * rules and torn-record discipline as the packet capture ring above, but
+ * carrying the full post-CRC tp_finger records before they get flattened
+ * into evdev events.
+ */
+struct applespi_tp_frame_hdr {
+	u32	nslots;
+	u32	slot_size;
+	u64	head;
+};
+
+struct applespi_tp_frame_slot {
+	u64			ts_ns;
+	u32			nfingers;
+	u32			clicked;
+	struct tp_finger	fingers[MAX_FINGERS];
+};
+
 /* this mimics struct drm_rect */
 struct applespi_tp_info {
 	int	x_min;
@@ -401,11 +527,91 @@ struct applespi_data {
 
 	u8				*tx_buffer;
 	u8				*tx_status;
-	u8				*rx_buffer;
 
+	/*
+	 * Ring of rx buffers. The buffer at @rx_ring_head is the one the next
+	 * read will dma into; the buffers from @rx_ring_tail up to (but not
+	 * including) @rx_ring_head are filled and awaiting parsing. The read
+	 * completion is the only producer (advancing @rx_ring_head) and the
+	 * parse thread the only consumer (advancing @rx_ring_tail), so no
+	 * locking is needed, just release/acquire pairs on head and tail.
+	 */
+	u8				*rx_buffers[APPLESPI_RX_RING_MAX];
+	unsigned int			rx_ring_len;
+	unsigned int			rx_ring_head;
+	unsigned int			rx_ring_tail;
+
+	/* per-slot timestamps feeding the latency histograms */
+	ktime_t				rx_irq_ts[APPLESPI_RX_RING_MAX];
+	ktime_t				rx_compl_ts[APPLESPI_RX_RING_MAX];
+	ktime_t				last_irq_ts;
+	ktime_t				cur_irq_ts;
+	ktime_t				cur_compl_ts;
+
+	/*
+	 * Latency histograms, only ever written from the parse thread, so
+	 * plain (unsynchronized) counters are fine.
+	 */
+	u64				lat_hist[LAT_NUM_STAGES][LAT_NUM_DEVS]
+						[LAT_NBUCKETS];
+
+	/*
+	 * Traffic statistics. Each counter has exactly one writer (the GPE
+	 * handler, the read completion, the parse thread or the locked send
+	 * path), so plain increments are safe; readers may see a slightly
+	 * stale but consistent-enough view.
+	 */
+	struct {
+		u64			irqs;
+		u64			keyboard_reads;
+		u64			touchpad_reads;
+		u64			cmd_responses;
+		u64			unknown_reads;
+		u64			crc_errors;
+		u64			corrupt_pkts;
+		u64			multi_pkt_msgs;
+		u64			dropped_pkts;
+		u64			empty_reads;
+		u64			bytes_read;
+		u64			cmds_sent;
+		u64			bytes_written;
+		u64			tp_frames_fast;
+		u64			tp_frames_full;
+	}				stats;
+
+	struct task_struct		*parse_task;
+	wait_queue_head_t		parse_wait;
+
+	/*
+	 * Hybrid interrupt/poll mode: while a stream of packets is arriving
+	 * the GPE is left unfinished (i.e. disabled) and further reads are
+	 * issued from @poll_timer instead, until @poll_empty_limit reads in a
+	 * row come back empty. All of these are only touched from the read
+	 * completion and the timer, which never run concurrently.
+	 */
+	bool				poll_enable;
+	u32				poll_interval_us;
+	u32				poll_empty_limit;
+	bool				polling;
+	unsigned int			poll_empty_reads;
+	struct hrtimer			poll_timer;
+
+	/*
+	 * Fragments of a partially received multi-packet message. The
+	 * fragments point directly into the rx ring buffers above, which the
+	 * parse thread keeps from being reused until the message is complete;
+	 * @msg_buf is only used to linearize the (rare) multi-packet messages
+	 * that aren't touchpad reads.
+	 */
+	const u8			*msg_frags[MAX_MSG_FRAGS];
+	unsigned int			msg_frag_lens[MAX_MSG_FRAGS];
+	unsigned int			msg_frag_cnt;
 	u8				*msg_buf;
 	unsigned int			saved_msg_len;
 
+	const struct tp_finger		*sc_fingers[MAX_FINGERS];
+	struct tp_finger		bounce_fingers[MAX_MSG_FRAGS - 1];
+
 	struct applespi_tp_info		tp_info;
 
 	u8				last_keys_pressed[MAX_ROLLOVER];
@@ -413,6 +619,14 @@ struct applespi_data {
 	u8				last_fn_pressed;
 	struct input_mt_pos		pos[MAX_FINGERS];
 	int				slots[MAX_FINGERS];
+
+	/*
+	 * Origins of the fingers reported in the previous frame; while they
+	 * are unchanged the slot assignments in @slots are carried over
+	 * as-is instead of being recomputed.
+	 */
+	u16				last_origins[MAX_FINGERS];
+	unsigned int			last_nfingers;
 	int				gpe;
 	acpi_handle			sien;
 	acpi_handle			sist;
@@ -421,26 +635,42 @@ struct applespi_data {
 	struct spi_transfer		rd_t;
 	struct spi_message		rd_m;
 
-	struct spi_transfer		ww_t;
 	struct spi_transfer		wd_t;
 	struct spi_transfer		wr_t;
 	struct spi_transfer		st_t;
 	struct spi_message		wr_m;
+	ktime_t				last_spi_done;
 
-	bool				want_tp_info_cmd;
-	bool				want_mt_init_cmd;
+	/*
+	 * Lock-free command queue: producers store their (coalesced) payload
+	 * in the want_* fields, set the command's bit in @cmd_pending and
+	 * kick the sender; they never take @cmd_msg_lock. The send path is
+	 * the single consumer and picks commands off @cmd_pending in
+	 * priority order.
+	 */
+	unsigned long			cmd_pending;
 	bool				want_cl_led_on;
 	bool				have_cl_led_on;
 	unsigned int			want_bl_level;
 	unsigned int			have_bl_level;
 	unsigned int			cmd_msg_cntr;
-	/* lock to protect the above parameters and flags below */
+	/* lock to protect the send path and the flags below */
 	spinlock_t			cmd_msg_lock;
 	ktime_t				cmd_msg_queued;
 	enum applespi_evt_type		cmd_evt_type;
 
 	struct led_classdev		backlight_info;
 
+	/*
+	 * Debounced EFI persistence of the backlight level: the level only
+	 * hits the (slow) EFI variable once it has been stable for a while,
+	 * and at shutdown/suspend. @saved_bl_level is the last value written.
+	 */
+	struct delayed_work		bl_save_work;
+	unsigned int			saved_bl_level;
+	/* probe work that first keystroke delivery doesn't depend on */
+	struct work_struct		late_init_work;
+
 	bool				suspended;
 	bool				drain;
 	wait_queue_head_t		drain_complete;
@@ -456,7 +686,33 @@ struct applespi_data {
 	wait_queue_head_t		tp_info_complete;
 	struct touchpad_info_protocol	rcvd_tp_info;
 
+	/*
+	 * debugfs packet injection / replay harness. Injected packets are
+	 * processed on the parse thread, like real ones, so that
+	 * applespi_got_data() stays single-consumer.
+	 */
+	struct mutex			inject_lock;
+	u8				*inject_buf;
+	unsigned int			inject_len;
+	unsigned int			inject_iters;
+	bool				inject_pending;
+	bool				bench_active;
+	struct completion		inject_done;
+	u32				replay_count;
+	u64				replay_elapsed_ns;
+	u64				replay_crc_ns;
+	char				replay_val[160];
+
+	/* raw packet capture ring (all packets are parsed on one thread) */
+	bool				capture_enable;
+	void				*capture_buf;
+
+	/* raw touchpad frame ring (written from the parse thread only) */
+	bool				tp_frames_enable;
+	void				*tp_frames_buf;
+
 	struct dentry			*debugfs_root;
+	u64				first_key_latency_ns;
 	bool				debug_tp_dim;
 	char				tp_dim_val[40];
 	int				tp_dim_min_x;
@@ -533,6 +789,17 @@ static const struct applespi_key_translation apple_iso_keyboard[] = {
 	{ }
 };
 
+/*
+ * Flattened scancode translation tables, indexed by fn-key state and raw
+ * scancode; these fold applespi_scancodes, applespi_translate_fn_key() and
+ * applespi_translate_iso_layout() into a single direct lookup. Because the
+ * fnmode and iso_layout module params are writable at runtime the tables are
+ * rebuilt whenever the params are seen to have changed.
+ */
+static u16 applespi_code_tables[2][U8_MAX + 1];
+static unsigned int applespi_code_tables_fnmode = UINT_MAX;	/* forces build */
+static bool applespi_code_tables_iso;
+
 struct applespi_tp_model_info {
 	u16			model;
 	struct applespi_tp_info	tp_info;
@@ -554,6 +821,113 @@ static const struct applespi_tp_model_info applespi_tp_models[] = {
 	{}
 };
 
+/*
+ * The kernel's crc16() processes one byte per table lookup, and with two crc
+ * passes over every received packet (packet crc + message crc) plus two more
+ * for every sent command, it ends up being the hottest function in this
+ * driver under sustained touchpad input. So use a slice-by-8 variant instead,
+ * which processes 8 input bytes per iteration. The tables are derived from
+ * the same CRC-16/ARC polynomial as crc16_table and are built once at probe
+ * time.
+ */
+static u16 applespi_crc16_tables[8][256];
+static bool applespi_crc16_use_tables;
+
+/* [0] = generic crc16(), [1] = slice-by-8; ns for 4096 crcs over one packet */
+static u64 applespi_crc16_bench_ns[2];
+
+static u16 applespi_crc16_sb8(u16 crc, const u8 *buffer, size_t len)
+{
+	const u16 (*t)[256] = applespi_crc16_tables;
+
+	while (len >= 8) {
+		u64 q = get_unaligned_le64(buffer) ^ crc;
+
+		crc = t[7][q & 0xff] ^ t[6][(q >> 8) & 0xff] ^
+		      t[5][(q >> 16) & 0xff] ^ t[4][(q >> 24) & 0xff] ^
+		      t[3][(q >> 32) & 0xff] ^ t[2][(q >> 40) & 0xff] ^
+		      t[1][(q >> 48) & 0xff] ^ t[0][q >> 56];
+
+		buffer += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *buffer++) & 0xff];
+
+	return crc;
+}
+
+static u16 applespi_crc16(u16 crc, const u8 *buffer, size_t len)
+{
+	if (likely(applespi_crc16_use_tables))
+		return applespi_crc16_sb8(crc, buffer, len);
+
+	return crc16(crc, buffer, len);
+}
+
+static u64 applespi_crc16_time(u16 (*crc_fun)(u16, const u8 *, size_t),
+			       const u8 *buffer, size_t len)
+{
+	ktime_t start;
+	u16 crc = 0;
+	int i;
+
+	start = ktime_get();
+
+	for (i = 0; i < 4096; i++)
+		crc = crc_fun(crc, buffer, len);
+
+	/* crc dependency between iterations keeps this from being elided */
+	return ktime_to_ns(ktime_sub(ktime_get(), start)) | (crc & 0);
+}
+
+static void applespi_crc16_init(struct applespi_data *applespi)
+{
+	u8 test_buf[APPLESPI_PACKET_SIZE];
+	u16 crc;
+	int i, j;
+
+	if (applespi_crc16_use_tables)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xa001 : 0);
+		applespi_crc16_tables[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc = applespi_crc16_tables[j - 1][i];
+			applespi_crc16_tables[j][i] = (crc >> 8) ^
+				      applespi_crc16_tables[0][crc & 0xff];
+		}
+	}
+
+	/* verify against the generic implementation on various lengths */
+	for (i = 0; i < sizeof(test_buf); i++)
+		test_buf[i] = i * 7 + 3;
+
+	for (i = 1; i <= sizeof(test_buf); i += 13) {
+		if (applespi_crc16_sb8(0, test_buf, i) !=
+		    crc16(0, test_buf, i)) {
+			dev_warn(&applespi->spi->dev,
+				 "slice-by-8 crc16 self-test failed - using generic crc16\n");
+			return;
+		}
+	}
+
+	applespi_crc16_bench_ns[0] = applespi_crc16_time(crc16, test_buf,
+							 sizeof(test_buf));
+	applespi_crc16_bench_ns[1] = applespi_crc16_time(applespi_crc16_sb8,
+							 test_buf,
+							 sizeof(test_buf));
+
+	applespi_crc16_use_tables = true;
+}
+
 typedef void (*applespi_trace_fun)(enum applespi_evt_type,
 				   enum applespi_pkt_type, u8 *, size_t);
 
@@ -589,7 +963,7 @@ static void applespi_setup_read_txfrs(struct applespi_data *applespi)
 
 	dl_t->delay_usecs = applespi->spi_settings.spi_cs_delay;
 
-	rd_t->rx_buf = applespi->rx_buffer;
+	rd_t->rx_buf = applespi->rx_buffers[applespi->rx_ring_head];
 	rd_t->len = APPLESPI_PACKET_SIZE;
 
 	spi_message_init(msg);
@@ -600,25 +974,21 @@ static void applespi_setup_read_txfrs(struct applespi_data *applespi)
 static void applespi_setup_write_txfrs(struct applespi_data *applespi)
 {
 	struct spi_message *msg = &applespi->wr_m;
-	struct spi_transfer *wt_t = &applespi->ww_t;
 	struct spi_transfer *dl_t = &applespi->wd_t;
 	struct spi_transfer *wr_t = &applespi->wr_t;
 	struct spi_transfer *st_t = &applespi->st_t;
 
-	memset(wt_t, 0, sizeof(*wt_t));
 	memset(dl_t, 0, sizeof(*dl_t));
 	memset(wr_t, 0, sizeof(*wr_t));
 	memset(st_t, 0, sizeof(*st_t));
 
 	/*
-	 * All we need here is a delay at the beginning of the message before
-	 * asserting cs. But the current spi API doesn't support this, so we
-	 * end up with an extra unnecessary (but harmless) cs assertion and
-	 * deassertion.
+	 * The exchange-turnaround delay needed before asserting cs is waited
+	 * out in applespi_send_cmd_msg() (based on when the last message
+	 * finished), as the spi API can't express a delay before the first
+	 * transfer; doing it with an empty leading transfer would cost an
+	 * extra cs assertion and deassertion per command.
 	 */
-	wt_t->delay_usecs = SPI_RW_CHG_DELAY_US;
-	wt_t->cs_change = 1;
-
 	dl_t->delay_usecs = applespi->spi_settings.spi_cs_delay;
 
 	wr_t->tx_buf = applespi->tx_buffer;
@@ -629,7 +999,6 @@ static void applespi_setup_write_txfrs(struct applespi_data *applespi)
 	st_t->len = APPLESPI_STATUS_SIZE;
 
 	spi_message_init(msg);
-	spi_message_add_tail(wt_t, msg);
 	spi_message_add_tail(dl_t, msg);
 	spi_message_add_tail(wr_t, msg);
 	spi_message_add_tail(st_t, msg);
@@ -648,6 +1017,9 @@ static void applespi_async_complete(void *context)
 	void (*complete)(void *);
 	unsigned long flags;
 
+	/* for the exchange-turnaround delay in applespi_send_cmd_msg() */
+	applespi->last_spi_done = ktime_get();
+
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
 	complete = info->complete;
@@ -747,6 +1119,13 @@ static const struct applespi_acpi_map_entry applespi_spi_settings_map[] = {
 
 static u8 *acpi_dsm_uuid = "a0b5b7c6-1318-441c-b0c9-fe695eaf949b";
 
+/*
+ * The spi settings can't change while the machine is up, so the result of
+ * the _DSM evaluation is cached across rebinds of the driver.
+ */
+static struct spi_settings applespi_saved_spi_settings;
+static bool applespi_have_spi_settings;
+
 static int applespi_find_settings_field(const char *name)
 {
 	int i;
@@ -774,6 +1153,11 @@ static int applespi_get_spi_settings(acpi_handle handle,
 	int field_off;
 	u64 *field;
 
+	if (applespi_have_spi_settings) {
+		*settings = applespi_saved_spi_settings;
+		return 0;
+	}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
 	guid_parse(acpi_dsm_uuid, uuid);
 #else
@@ -821,6 +1205,9 @@ static int applespi_get_spi_settings(acpi_handle handle,
 	}
 	ACPI_FREE(spi_info);
 
+	applespi_saved_spi_settings = *settings;
+	applespi_have_spi_settings = true;
+
 	return 0;
 }
 
@@ -879,6 +1266,7 @@ static int applespi_setup_spi(struct applespi_data *applespi
 	spin_lock_init(&applespi->cmd_msg_lock);
 	init_waitqueue_head(&applespi->drain_complete);
 	init_waitqueue_head(&applespi->tp_info_complete);
+	init_waitqueue_head(&applespi->parse_wait);
 
 	return 0;
 }
@@ -927,13 +1315,32 @@ static void applespi_msg_complete(struct applespi_data *applespi,
 	if (is_write_msg)
 		applespi->write_active = false;
 
+	/*
+	 * Pairs with the barrier in applespi_kick_cmd_msg(): the producer
+	 * sets its pending bit before testing write_active, so either it
+	 * sees the store above and starts the send itself, or the load below
+	 * sees its bit and we send on its behalf. The spinlock is no help
+	 * here - the producer's fast path doesn't take it, and a critical
+	 * section doesn't order an earlier store against a later load
+	 * (StoreLoad), so without a full barrier both sides can skip the
+	 * send and strand the command.
+	 */
+	smp_mb();
+
 	if (applespi->drain && !applespi->write_active)
 		wake_up_all(&applespi->drain_complete);
 
-	if (is_write_msg) {
+	if (is_write_msg)
 		applespi->cmd_msg_queued = 0;
+
+	/*
+	 * Send the next queued command, or one whose send was deferred
+	 * because the exchange that just finished was still in flight. The
+	 * cmd_pending check just keeps the idle read path free of the
+	 * test_and_clear cascade in applespi_send_cmd_msg().
+	 */
+	if (applespi->cmd_pending)
 		applespi_send_cmd_msg(applespi);
-	}
 
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 }
@@ -964,6 +1371,7 @@ static void applespi_async_write_complete(void *context)
 static int applespi_send_cmd_msg(struct applespi_data *applespi)
 {
 	u16 crc;
+	s64 elapsed;
 	int sts;
 	struct spi_packet *packet = (struct spi_packet *)applespi->tx_buffer;
 	struct message *message = (struct message *)packet->data;
@@ -974,6 +1382,15 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 	if (applespi->drain)
 		return 0;
 
+	/*
+	 * Starting the write now would put it on the bus back-to-back with
+	 * the in-flight read: the turnaround delay below only measures from
+	 * the last *completed* exchange, so the device would see no quiet
+	 * period at all. Defer; the read's completion re-runs this.
+	 */
+	if (applespi->read_active)
+		return 0;
+
 	/* check whether send is in progress */
 	if (applespi->cmd_msg_queued) {
 		if (ktime_ms_delta(ktime_get(), applespi->cmd_msg_queued) < 1000)
@@ -990,9 +1407,8 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 	memset(packet, 0, APPLESPI_PACKET_SIZE);
 
 	/* are we processing init commands? */
-	if (applespi->want_tp_info_cmd) {
-		applespi->want_tp_info_cmd = false;
-		applespi->want_mt_init_cmd = true;
+	if (test_and_clear_bit(CMD_TP_INFO, &applespi->cmd_pending)) {
+		set_bit(CMD_MT_INIT, &applespi->cmd_pending);
 		applespi->cmd_evt_type = ET_CMD_TP_INI;
 
 		/* build init command */
@@ -1004,8 +1420,7 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 		message->zero = 0x02;
 		message->rsp_buf_len = cpu_to_le16(0x0200);
 
-	} else if (applespi->want_mt_init_cmd) {
-		applespi->want_mt_init_cmd = false;
+	} else if (test_and_clear_bit(CMD_MT_INIT, &applespi->cmd_pending)) {
 		applespi->cmd_evt_type = ET_CMD_TP_INI;
 
 		/* build init command */
@@ -1017,8 +1432,10 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 		message->init_mt_command.cmd = cpu_to_le16(0x0102);
 
 	/* do we need caps-lock command? */
-	} else if (applespi->want_cl_led_on != applespi->have_cl_led_on) {
-		applespi->have_cl_led_on = applespi->want_cl_led_on;
+	} else if (test_and_clear_bit(CMD_CL_LED, &applespi->cmd_pending) &&
+		   READ_ONCE(applespi->want_cl_led_on) !=
+						applespi->have_cl_led_on) {
+		applespi->have_cl_led_on = !applespi->have_cl_led_on;
 		applespi->cmd_evt_type = ET_CMD_CL;
 
 		/* build led command */
@@ -1031,8 +1448,10 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 		message->capsl_command.led = applespi->have_cl_led_on ? 2 : 0;
 
 	/* do we need backlight command? */
-	} else if (applespi->want_bl_level != applespi->have_bl_level) {
-		applespi->have_bl_level = applespi->want_bl_level;
+	} else if (test_and_clear_bit(CMD_BL_LEVEL, &applespi->cmd_pending) &&
+		   READ_ONCE(applespi->want_bl_level) !=
+						applespi->have_bl_level) {
+		applespi->have_bl_level = READ_ONCE(applespi->want_bl_level);
 		applespi->cmd_evt_type = ET_CMD_BL;
 
 		/* build command buffer */
@@ -1066,12 +1485,21 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 	if (!message->rsp_buf_len)
 		message->rsp_buf_len = message->length;
 
-	crc = crc16(0, (u8 *)message, le16_to_cpu(packet->length) - 2);
+	crc = applespi_crc16(0, (u8 *)message, le16_to_cpu(packet->length) - 2);
 	put_unaligned_le16(crc, &message->data[msg_len - 2]);
 
-	crc = crc16(0, (u8 *)packet, sizeof(*packet) - 2);
+	crc = applespi_crc16(0, (u8 *)packet, sizeof(*packet) - 2);
 	packet->crc16 = cpu_to_le16(crc);
 
+	/*
+	 * The device needs a quiet period after the last exchange before a
+	 * write can be started; wait out whatever is left of it (usually
+	 * nothing).
+	 */
+	elapsed = ktime_us_delta(ktime_get(), applespi->last_spi_done);
+	if (elapsed < SPI_RW_CHG_DELAY_US)
+		udelay(SPI_RW_CHG_DELAY_US - elapsed);
+
 	/* send command */
 	sts = applespi_async(applespi, &applespi->wr_m,
 			     applespi_async_write_complete);
@@ -1084,38 +1512,56 @@ static int applespi_send_cmd_msg(struct applespi_data *applespi)
 	applespi->cmd_msg_queued = ktime_get();
 	applespi->write_active = true;
 
+	applespi->stats.cmds_sent++;
+	applespi->stats.bytes_written += APPLESPI_PACKET_SIZE +
+					 APPLESPI_STATUS_SIZE;
+
 	return 0;
 }
 
-static void applespi_init(struct applespi_data *applespi, bool is_resume)
+/*
+ * Called by producers after queueing a command in cmd_pending. If a write is
+ * currently in flight this is free of any locking or spinning: the write's
+ * completion re-runs applespi_send_cmd_msg() and is guaranteed to see the
+ * new command - the smp_mb__after_atomic() between setting the pending bit
+ * and testing write_active here pairs with the smp_mb() between clearing
+ * write_active and testing cmd_pending in applespi_msg_complete(). Only
+ * when the queue is idle do we need to start the send ourselves (which may
+ * still get deferred to the read completion if a read turns out to be in
+ * flight).
+ */
+static int applespi_kick_cmd_msg(struct applespi_data *applespi)
 {
 	unsigned long flags;
+	int sts;
 
-	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	smp_mb__after_atomic();
 
-	if (is_resume)
-		applespi->want_mt_init_cmd = true;
-	else
-		applespi->want_tp_info_cmd = true;
-	applespi_send_cmd_msg(applespi);
+	if (READ_ONCE(applespi->write_active))
+		return 0;
 
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	sts = applespi_send_cmd_msg(applespi);
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	return sts;
+}
+
+static void applespi_init(struct applespi_data *applespi, bool is_resume)
+{
+	set_bit(is_resume ? CMD_MT_INIT : CMD_TP_INFO, &applespi->cmd_pending);
+	applespi_kick_cmd_msg(applespi);
 }
 
 static int applespi_set_capsl_led(struct applespi_data *applespi,
 				  bool capslock_on)
 {
-	unsigned long flags;
-	int sts;
-
-	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
-
-	applespi->want_cl_led_on = capslock_on;
-	sts = applespi_send_cmd_msg(applespi);
-
-	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+	WRITE_ONCE(applespi->want_cl_led_on, capslock_on);
+	/* order the payload store before the pending bit */
+	smp_mb__before_atomic();
+	set_bit(CMD_CL_LED, &applespi->cmd_pending);
 
-	return sts;
+	return applespi_kick_cmd_msg(applespi);
 }
 
 static void applespi_set_bl_level(struct led_classdev *led_cdev,
@@ -1123,26 +1569,30 @@ static void applespi_set_bl_level(struct led_classdev *led_cdev,
 {
 	struct applespi_data *applespi =
 		container_of(led_cdev, struct applespi_data, backlight_info);
-	unsigned long flags;
-
-	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+	unsigned int level;
 
 	if (value == 0) {
-		applespi->want_bl_level = value;
+		level = value;
 	} else {
 		/*
 		 * The backlight does not turn on till level 32, so we scale
 		 * the range here so that from a user's perspective it turns
 		 * on at 1.
 		 */
-		applespi->want_bl_level =
-			((value * KBD_BL_LEVEL_ADJ) / KBD_BL_LEVEL_SCALE +
+		level = ((value * KBD_BL_LEVEL_ADJ) / KBD_BL_LEVEL_SCALE +
 			 KBD_BL_LEVEL_MIN);
 	}
 
-	applespi_send_cmd_msg(applespi);
+	/* a burst of brightness changes coalesces to the latest value */
+	WRITE_ONCE(applespi->want_bl_level, level);
+	/* order the payload store before the pending bit */
+	smp_mb__before_atomic();
+	set_bit(CMD_BL_LEVEL, &applespi->cmd_pending);
+	applespi_kick_cmd_msg(applespi);
 
-	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+	/* persist to EFI only once the level has been stable for a while */
+	mod_delayed_work(system_wq, &applespi->bl_save_work,
+			 msecs_to_jiffies(BL_SAVE_DELAY_MS));
 }
 
 static int applespi_event(struct input_dev *dev, unsigned int type,
@@ -1166,6 +1616,54 @@ static inline int le16_to_int(__le16 x)
 	return (signed short)le16_to_cpu(x);
 }
 
+static void applespi_lat_bucket(struct applespi_data *applespi,
+				enum applespi_lat_stage stage,
+				enum applespi_lat_dev dev, ktime_t delta)
+{
+	s64 us = ktime_to_us(delta);
+	unsigned int bucket;
+
+	bucket = us <= 0 ? 0 : min_t(unsigned int, ilog2(us) + 1,
+				     LAT_NBUCKETS - 1);
+	applespi->lat_hist[stage][dev][bucket]++;
+}
+
+/* called right after input_sync(); runs on the parse thread */
+static void applespi_lat_record(struct applespi_data *applespi,
+				enum applespi_lat_dev dev)
+{
+	ktime_t now;
+
+	if (!applespi->cur_irq_ts)
+		return;	/* injected packet */
+
+	now = ktime_get();
+
+	applespi_lat_bucket(applespi, LAT_IRQ_TO_COMPL, dev,
+			    ktime_sub(applespi->cur_compl_ts,
+				      applespi->cur_irq_ts));
+	applespi_lat_bucket(applespi, LAT_COMPL_TO_INPUT, dev,
+			    ktime_sub(now, applespi->cur_compl_ts));
+	applespi_lat_bucket(applespi, LAT_IRQ_TO_INPUT, dev,
+			    ktime_sub(now, applespi->cur_irq_ts));
+}
+
+/*
+ * Stamp the events about to be reported with the time the GPE fired for
+ * this packet instead of the time the input core gets to process them,
+ * removing the SPI-transfer/CRC/thread-hop jitter from what downstream
+ * velocity estimation sees. No-op for injected packets, and on kernels
+ * without input_set_timestamp().
+ */
+static void applespi_set_input_ts(struct applespi_data *applespi,
+				  struct input_dev *input)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+	if (applespi->cur_irq_ts)
+		input_set_timestamp(input, applespi->cur_irq_ts);
+#endif
+}
+
 static void applespi_debug_update_dimensions(struct applespi_data *applespi,
 					     const struct tp_finger *f)
 {
@@ -1211,87 +1709,501 @@ static const struct file_operations applespi_tp_dim_fops = {
 	.llseek = no_llseek,
 };
 
-static void report_finger_data(struct input_dev *input, int slot,
-			       const struct input_mt_pos *pos,
-			       const struct tp_finger *f)
+static unsigned int applespi_got_data(struct applespi_data *applespi,
+				      u8 *rx_buffer);
+
+/*
+ * Replay the injected packet stream inject_iters times. Runs on the parse
+ * thread so it is naturally serialized against real packets.
+ */
+static void applespi_run_injection(struct applespi_data *applespi)
 {
-	input_mt_slot(input, slot);
-	input_mt_report_slot_state(input, MT_TOOL_FINGER, true);
+	unsigned int npkts = applespi->inject_len / APPLESPI_PACKET_SIZE;
+	unsigned int i, p;
+	u64 start;
+
+	/* time one pass of just the packet crc verification */
+	start = ktime_get_ns();
+	for (p = 0; p < npkts; p++)
+		applespi_crc16(0, applespi->inject_buf +
+					p * APPLESPI_PACKET_SIZE,
+			       APPLESPI_PACKET_SIZE);
+	applespi->replay_crc_ns = ktime_get_ns() - start;
+
+	/* discard any partially assembled message, injected or real */
+	applespi->saved_msg_len = 0;
+	applespi->msg_frag_cnt = 0;
 
-	input_report_abs(input, ABS_MT_TOUCH_MAJOR,
-			 le16_to_int(f->touch_major) << 1);
-	input_report_abs(input, ABS_MT_TOUCH_MINOR,
-			 le16_to_int(f->touch_minor) << 1);
-	input_report_abs(input, ABS_MT_WIDTH_MAJOR,
-			 le16_to_int(f->tool_major) << 1);
-	input_report_abs(input, ABS_MT_WIDTH_MINOR,
-			 le16_to_int(f->tool_minor) << 1);
-	input_report_abs(input, ABS_MT_ORIENTATION,
-			 MAX_FINGER_ORIENTATION - le16_to_int(f->orientation));
-	input_report_abs(input, ABS_MT_POSITION_X, pos->x);
-	input_report_abs(input, ABS_MT_POSITION_Y, pos->y);
-}
+	/* injected packets have no hardware timestamps */
+	applespi->cur_irq_ts = 0;
+	applespi->cur_compl_ts = 0;
 
-static void report_tp_state(struct applespi_data *applespi,
-			    struct touchpad_protocol *t)
-{
-	const struct tp_finger *f;
-	struct input_dev *input;
-	const struct applespi_tp_info *tp_info = &applespi->tp_info;
-	int i, n;
+	applespi->bench_active = true;
 
-	/* touchpad_input_dev is set async in probe */
-	input = smp_load_acquire(&applespi->touchpad_input_dev);
-	if (!input)
-		return;	/* touchpad isn't initialized yet */
+	start = ktime_get_ns();
+	for (i = 0; i < applespi->inject_iters; i++)
+		for (p = 0; p < npkts; p++)
+			applespi_got_data(applespi, applespi->inject_buf +
+						    p * APPLESPI_PACKET_SIZE);
+	applespi->replay_elapsed_ns = ktime_get_ns() - start;
 
-	n = 0;
+	applespi->bench_active = false;
 
-	for (i = 0; i < t->number_of_fingers; i++) {
-		f = &t->fingers[i];
-		if (le16_to_int(f->touch_major) == 0)
-			continue;
-		applespi->pos[n].x = le16_to_int(f->abs_x);
-		applespi->pos[n].y = tp_info->y_min + tp_info->y_max -
-				     le16_to_int(f->abs_y);
-		n++;
+	applespi->saved_msg_len = 0;
+	applespi->msg_frag_cnt = 0;
 
-		if (applespi->debug_tp_dim)
-			applespi_debug_update_dimensions(applespi, f);
-	}
+	WRITE_ONCE(applespi->inject_pending, false);
+	complete(&applespi->inject_done);
+}
 
-	input_mt_assign_slots(input, applespi->slots, applespi->pos, n, 0);
+static ssize_t applespi_inject_write(struct file *file, const char __user *buf,
+				     size_t len, loff_t *off)
+{
+	struct applespi_data *applespi = file->private_data;
+	ssize_t sts;
 
-	for (i = 0; i < n; i++)
-		report_finger_data(input, applespi->slots[i],
-				   &applespi->pos[i], &t->fingers[i]);
+	mutex_lock(&applespi->inject_lock);
 
-	input_mt_sync_frame(input);
-	input_report_key(input, BTN_LEFT, t->clicked);
+	if (!applespi->inject_buf) {
+		applespi->inject_buf =
+			kmalloc_array(MAX_INJECT_PKTS, APPLESPI_PACKET_SIZE,
+				      GFP_KERNEL);
+		if (!applespi->inject_buf) {
+			mutex_unlock(&applespi->inject_lock);
+			return -ENOMEM;
+		}
+	}
 
-	input_sync(input);
+	sts = simple_write_to_buffer(applespi->inject_buf,
+				     MAX_INJECT_PKTS * APPLESPI_PACKET_SIZE,
+				     off, buf, len);
+	if (sts > 0)
+		applespi->inject_len = *off;
+
+	mutex_unlock(&applespi->inject_lock);
+
+	return sts;
 }
 
-static const struct applespi_key_translation *
-applespi_find_translation(const struct applespi_key_translation *table, u16 key)
+static int applespi_inject_open(struct inode *inode, struct file *file)
 {
-	const struct applespi_key_translation *trans;
-
-	for (trans = table; trans->from; trans++)
-		if (trans->from == key)
-			return trans;
+	file->private_data = inode->i_private;
 
-	return NULL;
+	return nonseekable_open(inode, file);
 }
 
-static unsigned int applespi_translate_fn_key(unsigned int key, int fn_pressed)
+static const struct file_operations applespi_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = applespi_inject_open,
+	.write = applespi_inject_write,
+	.llseek = no_llseek,
+};
+
+static int applespi_replay_open(struct inode *inode, struct file *file)
 {
-	const struct applespi_key_translation *trans;
-	int do_translate;
+	struct applespi_data *applespi = inode->i_private;
+	unsigned int npkts, total;
+	u64 pps;
 
-	trans = applespi_find_translation(applespi_fn_codes, key);
-	if (trans) {
-		if (trans->flags & APPLE_FLAG_FKEY)
+	file->private_data = applespi;
+
+	mutex_lock(&applespi->inject_lock);
+
+	if (!applespi->inject_len ||
+	    applespi->inject_len % APPLESPI_PACKET_SIZE) {
+		mutex_unlock(&applespi->inject_lock);
+		return -EINVAL;
+	}
+
+	npkts = applespi->inject_len / APPLESPI_PACKET_SIZE;
+	applespi->inject_iters = applespi->replay_count ? : 1;
+
+	reinit_completion(&applespi->inject_done);
+	WRITE_ONCE(applespi->inject_pending, true);
+	wake_up(&applespi->parse_wait);
+
+	if (!wait_for_completion_timeout(&applespi->inject_done,
+					 msecs_to_jiffies(30000))) {
+		WRITE_ONCE(applespi->inject_pending, false);
+		mutex_unlock(&applespi->inject_lock);
+		return -ETIMEDOUT;
+	}
+
+	total = npkts * applespi->inject_iters;
+	pps = applespi->replay_elapsed_ns ?
+		div64_u64((u64)total * NSEC_PER_SEC,
+			  applespi->replay_elapsed_ns) : 0;
+
+	snprintf(applespi->replay_val, sizeof(applespi->replay_val),
+		 "packets %u iters %u parse_ns %llu pkts_per_sec %llu crc_ns_per_pass %llu\n",
+		 npkts, applespi->inject_iters, applespi->replay_elapsed_ns,
+		 pps, applespi->replay_crc_ns);
+
+	mutex_unlock(&applespi->inject_lock);
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t applespi_replay_read(struct file *file, char __user *buf,
+				    size_t len, loff_t *off)
+{
+	struct applespi_data *applespi = file->private_data;
+
+	return simple_read_from_buffer(buf, len, off, applespi->replay_val,
+				       strlen(applespi->replay_val));
+}
+
+static const struct file_operations applespi_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = applespi_replay_open,
+	.read = applespi_replay_read,
+	.llseek = no_llseek,
+};
+
+static size_t applespi_capture_buf_size(void)
+{
+	return PAGE_ALIGN(CAPTURE_DATA_OFF + CAPTURE_NSLOTS *
+			  sizeof(struct applespi_capture_slot));
+}
+
+static void applespi_capture_packet(struct applespi_data *applespi,
+				    const u8 *buf)
+{
+	struct applespi_capture_hdr *hdr;
+	struct applespi_capture_slot *slot;
+
+	if (likely(!READ_ONCE(applespi->capture_enable)))
+		return;
+
+	hdr = READ_ONCE(applespi->capture_buf);
+	if (!hdr)
+		return;
+
+	slot = applespi->capture_buf + CAPTURE_DATA_OFF +
+	       (hdr->head % CAPTURE_NSLOTS) * sizeof(*slot);
+
+	slot->ts_ns = ktime_get_ns();
+	slot->len = APPLESPI_PACKET_SIZE;
+	memcpy(slot->data, buf, APPLESPI_PACKET_SIZE);
+
+	/* publish the record before advancing head */
+	smp_wmb();
+	WRITE_ONCE(hdr->head, hdr->head + 1);
+}
+
+static int applespi_capture_open(struct inode *inode, struct file *file)
+{
+	struct applespi_data *applespi = inode->i_private;
+	struct applespi_capture_hdr *hdr;
+	void *buf;
+
+	file->private_data = applespi;
+
+	if (!applespi->capture_buf) {
+		buf = vmalloc_user(applespi_capture_buf_size());
+		if (!buf)
+			return -ENOMEM;
+
+		hdr = buf;
+		hdr->nslots = CAPTURE_NSLOTS;
+		hdr->slot_size = sizeof(struct applespi_capture_slot);
+		hdr->head = 0;
+
+		/* initialize the header before making the ring visible */
+		smp_wmb();
+		if (cmpxchg(&applespi->capture_buf, NULL, buf))
+			vfree(buf);	/* raced with another open */
+	}
+
+	return nonseekable_open(inode, file);
+}
+
+static int applespi_capture_mmap(struct file *file,
+				 struct vm_area_struct *vma)
+{
+	struct applespi_data *applespi = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	return remap_vmalloc_range(vma, applespi->capture_buf, 0);
+}
+
+static const struct file_operations applespi_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = applespi_capture_open,
+	.mmap = applespi_capture_mmap,
+	.llseek = no_llseek,
+};
+
+static size_t applespi_tp_frames_buf_size(void)
+{
+	return PAGE_ALIGN(TP_FRAMES_DATA_OFF + TP_FRAMES_NSLOTS *
+			  sizeof(struct applespi_tp_frame_slot));
+}
+
+static void applespi_tp_frames_publish(struct applespi_data *applespi,
+				       const struct touchpad_protocol *t)
+{
+	struct applespi_tp_frame_hdr *hdr;
+	struct applespi_tp_frame_slot *slot;
+	int i;
+
+	if (likely(!READ_ONCE(applespi->tp_frames_enable)))
+		return;
+
+	hdr = READ_ONCE(applespi->tp_frames_buf);
+	if (!hdr)
+		return;
+
+	slot = applespi->tp_frames_buf + TP_FRAMES_DATA_OFF +
+	       (hdr->head % TP_FRAMES_NSLOTS) * sizeof(*slot);
+
+	slot->ts_ns = ktime_get_ns();
+	slot->nfingers = t->number_of_fingers;
+	slot->clicked = t->clicked;
+	for (i = 0; i < t->number_of_fingers; i++)
+		slot->fingers[i] = *applespi->sc_fingers[i];
+
+	/* publish the record before advancing head */
+	smp_wmb();
+	WRITE_ONCE(hdr->head, hdr->head + 1);
+}
+
+static int applespi_tp_frames_open(struct inode *inode, struct file *file)
+{
+	struct applespi_data *applespi = inode->i_private;
+	struct applespi_tp_frame_hdr *hdr;
+	void *buf;
+
+	file->private_data = applespi;
+
+	if (!applespi->tp_frames_buf) {
+		buf = vmalloc_user(applespi_tp_frames_buf_size());
+		if (!buf)
+			return -ENOMEM;
+
+		hdr = buf;
+		hdr->nslots = TP_FRAMES_NSLOTS;
+		hdr->slot_size = sizeof(struct applespi_tp_frame_slot);
+		hdr->head = 0;
+
+		/* initialize the header before making the ring visible */
+		smp_wmb();
+		if (cmpxchg(&applespi->tp_frames_buf, NULL, buf))
+			vfree(buf);	/* raced with another open */
+	}
+
+	return nonseekable_open(inode, file);
+}
+
+static int applespi_tp_frames_mmap(struct file *file,
+				   struct vm_area_struct *vma)
+{
+	struct applespi_data *applespi = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	return remap_vmalloc_range(vma, applespi->tp_frames_buf, 0);
+}
+
+static const struct file_operations applespi_tp_frames_fops = {
+	.owner = THIS_MODULE,
+	.open = applespi_tp_frames_open,
+	.mmap = applespi_tp_frames_mmap,
+	.llseek = no_llseek,
+};
+
+static int applespi_lat_hist_show(struct seq_file *s, void *unused)
+{
+	static const char *const stage_names[LAT_NUM_STAGES] = {
+		"irq_to_compl", "compl_to_input", "irq_to_input"
+	};
+	static const char *const dev_names[LAT_NUM_DEVS] = {
+		"keyb", "tpad"
+	};
+	struct applespi_data *applespi = s->private;
+	unsigned int st, d, b;
+
+	seq_puts(s, "# log2(us) buckets; bucket n counts latencies < 2^n us\n");
+
+	for (st = 0; st < LAT_NUM_STAGES; st++) {
+		for (d = 0; d < LAT_NUM_DEVS; d++) {
+			seq_printf(s, "%s %s:", stage_names[st], dev_names[d]);
+			for (b = 0; b < LAT_NBUCKETS; b++)
+				seq_printf(s, " %llu",
+					   applespi->lat_hist[st][d][b]);
+			seq_putc(s, '\n');
+		}
+	}
+
+	return 0;
+}
+
+static int applespi_lat_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, applespi_lat_hist_show, inode->i_private);
+}
+
+static const struct file_operations applespi_lat_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = applespi_lat_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int applespi_stats_show(struct seq_file *s, void *unused)
+{
+	struct applespi_data *applespi = s->private;
+
+	seq_printf(s, "irqs %llu\n", applespi->stats.irqs);
+	seq_printf(s, "keyboard_reads %llu\n", applespi->stats.keyboard_reads);
+	seq_printf(s, "touchpad_reads %llu\n", applespi->stats.touchpad_reads);
+	seq_printf(s, "cmd_responses %llu\n", applespi->stats.cmd_responses);
+	seq_printf(s, "unknown_reads %llu\n", applespi->stats.unknown_reads);
+	seq_printf(s, "crc_errors %llu\n", applespi->stats.crc_errors);
+	seq_printf(s, "corrupt_pkts %llu\n", applespi->stats.corrupt_pkts);
+	seq_printf(s, "multi_pkt_msgs %llu\n", applespi->stats.multi_pkt_msgs);
+	seq_printf(s, "dropped_pkts %llu\n", applespi->stats.dropped_pkts);
+	seq_printf(s, "empty_reads %llu\n", applespi->stats.empty_reads);
+	seq_printf(s, "bytes_read %llu\n", applespi->stats.bytes_read);
+	seq_printf(s, "cmds_sent %llu\n", applespi->stats.cmds_sent);
+	seq_printf(s, "bytes_written %llu\n", applespi->stats.bytes_written);
+	seq_printf(s, "tp_frames_fast %llu\n", applespi->stats.tp_frames_fast);
+	seq_printf(s, "tp_frames_full %llu\n", applespi->stats.tp_frames_full);
+
+	return 0;
+}
+
+static int applespi_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, applespi_stats_show, inode->i_private);
+}
+
+static const struct file_operations applespi_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = applespi_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void report_finger_data(struct input_dev *input, int slot,
+			       const struct input_mt_pos *pos,
+			       const struct tp_finger *f)
+{
+	input_mt_slot(input, slot);
+	input_mt_report_slot_state(input, MT_TOOL_FINGER, true);
+
+	input_report_abs(input, ABS_MT_TOUCH_MAJOR,
+			 le16_to_int(f->touch_major) << 1);
+	input_report_abs(input, ABS_MT_TOUCH_MINOR,
+			 le16_to_int(f->touch_minor) << 1);
+	input_report_abs(input, ABS_MT_WIDTH_MAJOR,
+			 le16_to_int(f->tool_major) << 1);
+	input_report_abs(input, ABS_MT_WIDTH_MINOR,
+			 le16_to_int(f->tool_minor) << 1);
+	input_report_abs(input, ABS_MT_ORIENTATION,
+			 MAX_FINGER_ORIENTATION - le16_to_int(f->orientation));
+	input_report_abs(input, ABS_MT_POSITION_X, pos->x);
+	input_report_abs(input, ABS_MT_POSITION_Y, pos->y);
+}
+
+static void report_tp_state(struct applespi_data *applespi,
+			    struct touchpad_protocol *t)
+{
+	const struct tp_finger *f;
+	struct input_dev *input;
+	const struct applespi_tp_info *tp_info = &applespi->tp_info;
+	u16 origins[MAX_FINGERS];
+	bool same_fingers;
+	int i, n;
+
+	/* full-fidelity finger records, before the evdev flattening below */
+	applespi_tp_frames_publish(applespi, t);
+
+	/* touchpad_input_dev is set async in probe */
+	input = smp_load_acquire(&applespi->touchpad_input_dev);
+	if (!input)
+		return;	/* touchpad isn't initialized yet */
+
+	n = 0;
+
+	for (i = 0; i < t->number_of_fingers; i++) {
+		f = applespi->sc_fingers[i];
+		if (le16_to_int(f->touch_major) == 0)
+			continue;
+		applespi->pos[n].x = le16_to_int(f->abs_x);
+		applespi->pos[n].y = tp_info->y_min + tp_info->y_max -
+				     le16_to_int(f->abs_y);
+		origins[n] = le16_to_cpu(f->origin);
+		n++;
+
+		if (applespi->debug_tp_dim)
+			applespi_debug_update_dimensions(applespi, f);
+	}
+
+	/*
+	 * If the same fingers are down as in the previous frame (continuity
+	 * of the origin tracking ids), the slot assignments can't have
+	 * changed either and @slots is still valid from last time; only when
+	 * fingers appear, disappear or get reordered is the full assignment
+	 * algorithm run.
+	 */
+	same_fingers = n == applespi->last_nfingers;
+
+	for (i = 0; same_fingers && i < n; i++)
+		same_fingers = origins[i] == applespi->last_origins[i];
+
+	applespi_set_input_ts(applespi, input);
+
+	if (same_fingers) {
+		applespi->stats.tp_frames_fast++;
+	} else {
+		input_mt_assign_slots(input, applespi->slots, applespi->pos,
+				      n, 0);
+
+		memcpy(applespi->last_origins, origins,
+		       n * sizeof(origins[0]));
+		applespi->last_nfingers = n;
+
+		applespi->stats.tp_frames_full++;
+	}
+
+	for (i = 0; i < n; i++)
+		report_finger_data(input, applespi->slots[i],
+				   &applespi->pos[i], applespi->sc_fingers[i]);
+
+	input_mt_sync_frame(input);
+	input_report_key(input, BTN_LEFT, t->clicked);
+
+	input_sync(input);
+
+	applespi_lat_record(applespi, LAT_DEV_TPAD);
+}
+
+static const struct applespi_key_translation *
+applespi_find_translation(const struct applespi_key_translation *table, u16 key)
+{
+	const struct applespi_key_translation *trans;
+
+	for (trans = table; trans->from; trans++)
+		if (trans->from == key)
+			return trans;
+
+	return NULL;
+}
+
+static unsigned int applespi_translate_fn_key(unsigned int key, int fn_pressed)
+{
+	const struct applespi_key_translation *trans;
+	int do_translate;
+
+	trans = applespi_find_translation(applespi_fn_codes, key);
+	if (trans) {
+		if (trans->flags & APPLE_FLAG_FKEY)
 			do_translate = (fnmode == 2 && fn_pressed) ||
 				       (fnmode == 1 && !fn_pressed);
 		else
@@ -1315,7 +2227,7 @@ static unsigned int applespi_translate_iso_layout(unsigned int key)
 	return key;
 }
 
-static unsigned int applespi_code_to_key(u8 code, int fn_pressed)
+static unsigned int applespi_translate_code(u8 code, int fn_pressed)
 {
 	unsigned int key = applespi_scancodes[code];
 
@@ -1326,6 +2238,35 @@ static unsigned int applespi_code_to_key(u8 code, int fn_pressed)
 	return key;
 }
 
+static void applespi_build_code_tables(void)
+{
+	unsigned int code;
+
+	for (code = 0; code <= U8_MAX; code++) {
+		if (code < ARRAY_SIZE(applespi_scancodes)) {
+			applespi_code_tables[0][code] =
+					applespi_translate_code(code, 0);
+			applespi_code_tables[1][code] =
+					applespi_translate_code(code, 1);
+		} else {
+			applespi_code_tables[0][code] = 0;
+			applespi_code_tables[1][code] = 0;
+		}
+	}
+
+	applespi_code_tables_fnmode = fnmode;
+	applespi_code_tables_iso = iso_layout;
+}
+
+static unsigned int applespi_code_to_key(u8 code, int fn_pressed)
+{
+	if (unlikely(fnmode != applespi_code_tables_fnmode ||
+		     iso_layout != applespi_code_tables_iso))
+		applespi_build_code_tables();
+
+	return applespi_code_tables[!!fn_pressed][code];
+}
+
 static void
 applespi_remap_fn_key(struct keyboard_protocol *keyboard_protocol)
 {
@@ -1348,6 +2289,7 @@ static void
 applespi_handle_keyboard_event(struct applespi_data *applespi,
 			       struct keyboard_protocol *keyboard_protocol)
 {
+	DECLARE_BITMAP(keys_pressed, U8_MAX + 1) = { 0 };
 	unsigned int key;
 	int i;
 
@@ -1362,10 +2304,15 @@ applespi_handle_keyboard_event(struct applespi_data *applespi,
 	/* remap fn key if desired */
 	applespi_remap_fn_key(keyboard_protocol);
 
+	applespi_set_input_ts(applespi, applespi->keyboard_input_dev);
+
+	/* note which scancodes are down, for O(1) release detection below */
+	for (i = 0; i < MAX_ROLLOVER; i++)
+		__set_bit(keyboard_protocol->keys_pressed[i], keys_pressed);
+
 	/* check released keys */
 	for (i = 0; i < MAX_ROLLOVER; i++) {
-		if (memchr(keyboard_protocol->keys_pressed,
-			   applespi->last_keys_pressed[i], MAX_ROLLOVER))
+		if (test_bit(applespi->last_keys_pressed[i], keys_pressed))
 			continue;	/* key is still pressed */
 
 		key = applespi_code_to_key(applespi->last_keys_pressed[i],
@@ -1409,6 +2356,12 @@ applespi_handle_keyboard_event(struct applespi_data *applespi,
 	input_sync(applespi->keyboard_input_dev);
 	memcpy(&applespi->last_keys_pressed, keyboard_protocol->keys_pressed,
 	       sizeof(applespi->last_keys_pressed));
+
+	applespi_lat_record(applespi, LAT_DEV_KEYB);
+
+	if (unlikely(!applespi->first_key_latency_ns))
+		applespi->first_key_latency_ns =
+			ktime_to_ns(ktime_sub(ktime_get(), applespi_start_ts));
 }
 
 static const struct applespi_tp_info *applespi_find_touchpad_info(u8 model)
@@ -1573,7 +2526,7 @@ static bool applespi_verify_crc(struct applespi_data *applespi, u8 *buffer,
 {
 	u16 crc;
 
-	crc = crc16(0, buffer, buflen);
+	crc = applespi_crc16(0, buffer, buflen);
 	if (crc) {
 		dev_warn_ratelimited(&applespi->spi->dev,
 				     "Received corrupted packet (crc mismatch)\n");
@@ -1585,27 +2538,144 @@ static bool applespi_verify_crc(struct applespi_data *applespi, u8 *buffer,
 	return true;
 }
 
+/*
+ * Direct tracepoint calls: each trace_applespi_*() below is gated by its
+ * tracepoint's static key, so with tracing disabled this whole function
+ * costs a few compares and patched-out nops - no function-pointer dispatch
+ * and no argument evaluation.
+ */
 static void applespi_debug_print_read_packet(struct applespi_data *applespi,
 					     struct spi_packet *packet)
 {
-	unsigned int evt_type;
+	u8 *buf = (u8 *)packet;
 
 	if (packet->flags == PACKET_TYPE_READ &&
-	    packet->device == PACKET_DEV_KEYB)
-		evt_type = ET_RD_KEYB;
-	else if (packet->flags == PACKET_TYPE_READ &&
-		 packet->device == PACKET_DEV_TPAD)
-		evt_type = ET_RD_TPAD;
-	else if (packet->flags == PACKET_TYPE_WRITE)
-		evt_type = applespi->cmd_evt_type;
-	else
-		evt_type = ET_RD_UNKN;
+	    packet->device == PACKET_DEV_KEYB) {
+		trace_applespi_keyboard_data(ET_RD_KEYB, PT_READ, buf,
+					     APPLESPI_PACKET_SIZE);
+	} else if (packet->flags == PACKET_TYPE_READ &&
+		   packet->device == PACKET_DEV_TPAD) {
+		trace_applespi_touchpad_data(ET_RD_TPAD, PT_READ, buf,
+					     APPLESPI_PACKET_SIZE);
+	} else if (packet->flags == PACKET_TYPE_WRITE) {
+		switch (applespi->cmd_evt_type) {
+		case ET_CMD_TP_INI:
+			trace_applespi_tp_ini_cmd(ET_CMD_TP_INI, PT_READ, buf,
+						  APPLESPI_PACKET_SIZE);
+			break;
+		case ET_CMD_BL:
+			trace_applespi_backlight_cmd(ET_CMD_BL, PT_READ, buf,
+						     APPLESPI_PACKET_SIZE);
+			break;
+		case ET_CMD_CL:
+			trace_applespi_caps_lock_cmd(ET_CMD_CL, PT_READ, buf,
+						     APPLESPI_PACKET_SIZE);
+			break;
+		default:
+			trace_applespi_unknown_data(applespi->cmd_evt_type,
+						    PT_READ, buf,
+						    APPLESPI_PACKET_SIZE);
+			break;
+		}
+	} else {
+		trace_applespi_unknown_data(ET_RD_UNKN, PT_READ, buf,
+					    APPLESPI_PACKET_SIZE);
+	}
+}
 
-	applespi_get_trace_fun(evt_type)(evt_type, PT_READ, applespi->rx_buffer,
-					 APPLESPI_PACKET_SIZE);
+static bool applespi_verify_msg_crc(struct applespi_data *applespi)
+{
+	u16 crc = 0;
+	unsigned int i;
+
+	for (i = 0; i < applespi->msg_frag_cnt; i++)
+		crc = applespi_crc16(crc, applespi->msg_frags[i],
+				     applespi->msg_frag_lens[i]);
+
+	if (crc) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Received corrupted packet (crc mismatch)\n");
+		trace_applespi_bad_crc(ET_RD_CRC, READ,
+				       (u8 *)applespi->msg_frags[0],
+				       applespi->msg_frag_lens[0]);
+		return false;
+	}
+
+	return true;
+}
+
+static void applespi_linearize_msg(struct applespi_data *applespi)
+{
+	unsigned int i;
+	unsigned int off = 0;
+
+	for (i = 0; i < applespi->msg_frag_cnt; i++) {
+		memcpy(applespi->msg_buf + off, applespi->msg_frags[i],
+		       applespi->msg_frag_lens[i]);
+		off += applespi->msg_frag_lens[i];
+	}
+}
+
+/*
+ * Set up the per-finger pointers for report_tp_state(). For messages split
+ * over multiple packets the finger records are referenced in-place in the
+ * retained rx ring buffers; only a record that genuinely straddles a packet
+ * boundary is copied out (at most one per boundary).
+ */
+static void applespi_collect_fingers(struct applespi_data *applespi,
+				     struct touchpad_protocol *tp, bool scatter)
+{
+	unsigned int foff, frag_start, frag, chunk, todo;
+	unsigned int i, b = 0;
+	u8 *dst;
+
+	if (!scatter) {
+		for (i = 0; i < tp->number_of_fingers; i++)
+			applespi->sc_fingers[i] = &tp->fingers[i];
+		return;
+	}
+
+	foff = MSG_HEADER_SIZE + sizeof(*tp);
+	frag = 0;
+	frag_start = 0;
+
+	for (i = 0; i < tp->number_of_fingers;
+	     i++, foff += sizeof(struct tp_finger)) {
+		while (foff >= frag_start + applespi->msg_frag_lens[frag]) {
+			frag_start += applespi->msg_frag_lens[frag];
+			frag++;
+		}
+
+		if (foff + sizeof(struct tp_finger) <=
+		    frag_start + applespi->msg_frag_lens[frag]) {
+			applespi->sc_fingers[i] = (const struct tp_finger *)
+				(applespi->msg_frags[frag] + foff - frag_start);
+			continue;
+		}
+
+		/* finger record straddles a packet boundary */
+		dst = (u8 *)&applespi->bounce_fingers[b];
+		todo = sizeof(struct tp_finger);
+
+		chunk = frag_start + applespi->msg_frag_lens[frag] - foff;
+		memcpy(dst, applespi->msg_frags[frag] + foff - frag_start,
+		       chunk);
+
+		while ((todo -= chunk) > 0) {
+			dst += chunk;
+			chunk = min_t(unsigned int, todo,
+				      applespi->msg_frag_lens[frag + 1]);
+			memcpy(dst, applespi->msg_frags[++frag], chunk);
+			frag_start += applespi->msg_frag_lens[frag - 1];
+		}
+
+		applespi->sc_fingers[i] = &applespi->bounce_fingers[b];
+		b++;
+	}
 }
 
-static void applespi_got_data(struct applespi_data *applespi)
+static unsigned int applespi_got_data(struct applespi_data *applespi,
+				      u8 *rx_buffer)
 {
 	struct spi_packet *packet;
 	struct message *message;
@@ -1613,16 +2683,20 @@ static void applespi_got_data(struct applespi_data *applespi)
 	unsigned int off;
 	unsigned int rem;
 	unsigned int len;
+	bool scatter = false;
 
 	/* process packet header */
-	if (!applespi_verify_crc(applespi, applespi->rx_buffer,
-				 APPLESPI_PACKET_SIZE)) {
+	if (!applespi_verify_crc(applespi, rx_buffer, APPLESPI_PACKET_SIZE)) {
 		unsigned long flags;
 
 		spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
 		if (applespi->drain) {
-			applespi->read_active = false;
+			/*
+			 * This may have been the response to a write we will
+			 * now never recognize; don't stall the drain on it.
+			 * (read_active is owned by the read completion.)
+			 */
 			applespi->write_active = false;
 
 			wake_up_all(&applespi->drain_complete);
@@ -1630,12 +2704,28 @@ static void applespi_got_data(struct applespi_data *applespi)
 
 		spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
-		return;
+		applespi->stats.crc_errors++;
+
+		/*
+		 * If a message was being assembled, this was in all likelihood
+		 * its (now corrupted) continuation, so the message is beyond
+		 * saving. It must be discarded in any case: the held-buffer
+		 * accounting defines the fragments as the most recently
+		 * consumed buffers, and keeping them across this non-fragment
+		 * packet would retain its buffer instead of the oldest
+		 * fragment's, letting the next read DMA over data that
+		 * msg_frags[] still points into.
+		 */
+		applespi->saved_msg_len = 0;
+		applespi->msg_frag_cnt = 0;
+
+		return 0;
 	}
 
-	packet = (struct spi_packet *)applespi->rx_buffer;
+	packet = (struct spi_packet *)rx_buffer;
 
 	applespi_debug_print_read_packet(applespi, packet);
+	applespi_capture_packet(applespi, rx_buffer);
 
 	off = le16_to_cpu(packet->offset);
 	rem = le16_to_cpu(packet->remaining);
@@ -1645,6 +2735,7 @@ static void applespi_got_data(struct applespi_data *applespi)
 		dev_warn_ratelimited(&applespi->spi->dev,
 				     "Received corrupted packet (invalid packet length %u)\n",
 				     len);
+		applespi->stats.corrupt_pkts++;
 		goto msg_complete;
 	}
 
@@ -1654,6 +2745,7 @@ static void applespi_got_data(struct applespi_data *applespi)
 			dev_warn_ratelimited(&applespi->spi->dev,
 					     "Received unexpected offset (got %u, expected %u)\n",
 					     off, applespi->saved_msg_len);
+			applespi->stats.corrupt_pkts++;
 			goto msg_complete;
 		}
 
@@ -1661,6 +2753,7 @@ static void applespi_got_data(struct applespi_data *applespi)
 			dev_warn_ratelimited(&applespi->spi->dev,
 					     "Received message too large (size %u)\n",
 					     off + rem);
+			applespi->stats.corrupt_pkts++;
 			goto msg_complete;
 		}
 
@@ -1668,79 +2761,348 @@ static void applespi_got_data(struct applespi_data *applespi)
 			dev_warn_ratelimited(&applespi->spi->dev,
 					     "Received message too large (size %u)\n",
 					     off + len);
+			applespi->stats.corrupt_pkts++;
+			goto msg_complete;
+		}
+
+		if (applespi->msg_frag_cnt >= MAX_MSG_FRAGS) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Received message in too many fragments (> %u)\n",
+					     MAX_MSG_FRAGS);
+			applespi->stats.corrupt_pkts++;
+			goto msg_complete;
+		}
+
+		/*
+		 * Save a reference to the payload instead of copying it out;
+		 * the underlying rx ring buffer is retained (not handed back
+		 * to the read completion) until the message is done with.
+		 */
+		applespi->msg_frags[applespi->msg_frag_cnt] = packet->data;
+		applespi->msg_frag_lens[applespi->msg_frag_cnt] = len;
+		applespi->msg_frag_cnt++;
+		applespi->saved_msg_len += len;
+
+		if (rem > 0)
+			return applespi->msg_frag_cnt;
+
+		applespi->stats.multi_pkt_msgs++;
+		msg_len = applespi->saved_msg_len;
+
+		if (packet->flags == PACKET_TYPE_READ &&
+		    packet->device == PACKET_DEV_TPAD &&
+		    applespi->msg_frag_lens[0] >=
+				MSG_HEADER_SIZE + sizeof(struct touchpad_protocol)) {
+			/* parse the fingers straight out of the fragments */
+			scatter = true;
+			message = (struct message *)applespi->msg_frags[0];
+		} else {
+			/* rare (e.g. a large command response) - linearize */
+			applespi_linearize_msg(applespi);
+			message = (struct message *)applespi->msg_buf;
+		}
+	} else {
+		message = (struct message *)&packet->data;
+		msg_len = len;
+	}
+
+	/* got complete message - verify */
+	if (applespi->msg_frag_cnt) {
+		if (!applespi_verify_msg_crc(applespi)) {
+			applespi->stats.crc_errors++;
+			goto msg_complete;
+		}
+	} else {
+		if (!applespi_verify_crc(applespi, (u8 *)message, msg_len)) {
+			applespi->stats.crc_errors++;
+			goto msg_complete;
+		}
+	}
+
+	if (le16_to_cpu(message->length) != msg_len - MSG_HEADER_SIZE - 2) {
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "Received corrupted packet (invalid message length %u - expected %u)\n",
+				     le16_to_cpu(message->length),
+				     msg_len - MSG_HEADER_SIZE - 2);
+		applespi->stats.corrupt_pkts++;
+		goto msg_complete;
+	}
+
+	/* handle message */
+	if (packet->flags == PACKET_TYPE_READ &&
+	    packet->device == PACKET_DEV_KEYB) {
+		applespi->stats.keyboard_reads++;
+		applespi_handle_keyboard_event(applespi, &message->keyboard);
+
+	} else if (packet->flags == PACKET_TYPE_READ &&
+		   packet->device == PACKET_DEV_TPAD) {
+		struct touchpad_protocol *tp;
+		size_t tp_len;
+
+		applespi->stats.touchpad_reads++;
+		tp = &message->touchpad;
+		tp_len = struct_size(tp, fingers, tp->number_of_fingers);
+
+		if (le16_to_cpu(message->length) + 2 != tp_len) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Received corrupted packet (invalid message length %u - num-fingers %u, tp-len %zu)\n",
+					     le16_to_cpu(message->length),
+					     tp->number_of_fingers, tp_len);
+			applespi->stats.corrupt_pkts++;
 			goto msg_complete;
 		}
 
-		memcpy(applespi->msg_buf + off, &packet->data, len);
-		applespi->saved_msg_len += len;
+		if (tp->number_of_fingers > MAX_FINGERS) {
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Number of reported fingers (%u) exceeds max (%u))\n",
+					     tp->number_of_fingers,
+					     MAX_FINGERS);
+			tp->number_of_fingers = MAX_FINGERS;
+		}
+
+		applespi_collect_fingers(applespi, tp, scatter);
+		report_tp_state(applespi, tp);
+
+	} else if (packet->flags == PACKET_TYPE_WRITE) {
+		applespi->stats.cmd_responses++;
+		applespi_handle_cmd_response(applespi, packet, message);
+	} else {
+		applespi->stats.unknown_reads++;
+	}
+
+msg_complete:
+	applespi->saved_msg_len = 0;
+	applespi->msg_frag_cnt = 0;
+
+	/*
+	 * Complete the command handshake for write responses; the read itself
+	 * was already completed by the read completion. Injected packets never
+	 * correspond to an actual spi exchange.
+	 */
+	if (!applespi->bench_active && packet->flags == PACKET_TYPE_WRITE)
+		applespi_msg_complete(applespi, true, false);
+
+	return 0;
+}
+
+#ifdef APPLESPI_BENCH
+
+#include "applespi_bench.h"
+
+/*
+ * Entry points for the applespi_bench module (see "make bench"). They run
+ * the real parse path over caller-built packets on a private applespi_data
+ * instance, so hot-path changes can be timed on machines without the actual
+ * hardware. Never compiled into regular builds.
+ */
+
+u16 applespi_bench_crc16(u16 crc, const u8 *buffer, size_t len, bool sb8)
+{
+	return sb8 ? applespi_crc16_sb8(crc, buffer, len) :
+		     crc16(crc, buffer, len);
+}
+EXPORT_SYMBOL_GPL(applespi_bench_crc16);
+
+unsigned int applespi_bench_code_to_key(u8 code, int fn_pressed)
+{
+	return applespi_code_to_key(code, fn_pressed);
+}
+EXPORT_SYMBOL_GPL(applespi_bench_code_to_key);
+
+void applespi_bench_free(struct applespi_data *applespi)
+{
+	if (!applespi)
+		return;
+
+	input_free_device(applespi->keyboard_input_dev);
+	kfree(applespi->msg_buf);
+	kfree(applespi);
+}
+EXPORT_SYMBOL_GPL(applespi_bench_free);
+
+struct applespi_data *applespi_bench_alloc(void)
+{
+	struct applespi_data *applespi;
+
+	BUILD_BUG_ON(APPLESPI_BENCH_PACKET_SIZE != APPLESPI_PACKET_SIZE);
+	BUILD_BUG_ON(APPLESPI_BENCH_MAX_PKTS_PER_MSG != MAX_PKTS_PER_MSG);
+
+	applespi = kzalloc(sizeof(*applespi), GFP_KERNEL);
+	if (!applespi)
+		return NULL;
+
+	applespi->msg_buf = kmalloc_array(MAX_PKTS_PER_MSG,
+					  APPLESPI_PACKET_SIZE, GFP_KERNEL);
+
+	/* allocated but never registered; reported events are just dropped */
+	applespi->keyboard_input_dev = input_allocate_device();
+
+	if (!applespi->msg_buf || !applespi->keyboard_input_dev) {
+		applespi_bench_free(applespi);
+		return NULL;
+	}
+
+	spin_lock_init(&applespi->cmd_msg_lock);
+	init_waitqueue_head(&applespi->drain_complete);
+
+	applespi_crc16_init(applespi);
+
+	/* benched packets never correspond to an actual spi exchange */
+	applespi->bench_active = true;
+
+	return applespi;
+}
+EXPORT_SYMBOL_GPL(applespi_bench_alloc);
+
+unsigned int applespi_bench_parse(struct applespi_data *applespi, u8 *pkts,
+				  unsigned int npkts)
+{
+	unsigned int held = 0;
+	unsigned int p;
+
+	for (p = 0; p < npkts; p++)
+		held = applespi_got_data(applespi,
+					 pkts + p * APPLESPI_PACKET_SIZE);
+
+	/* drop any partially assembled message between runs */
+	applespi->saved_msg_len = 0;
+	applespi->msg_frag_cnt = 0;
+
+	return held;
+}
+EXPORT_SYMBOL_GPL(applespi_bench_parse);
+
+u64 applespi_bench_error_count(struct applespi_data *applespi)
+{
+	return applespi->stats.crc_errors + applespi->stats.corrupt_pkts;
+}
+EXPORT_SYMBOL_GPL(applespi_bench_error_count);
+
+static void applespi_bench_finish_packet(struct spi_packet *packet, u8 device,
+					 unsigned int off, unsigned int rem,
+					 unsigned int len)
+{
+	u16 crc;
+
+	packet->flags = PACKET_TYPE_READ;
+	packet->device = device;
+	packet->offset = cpu_to_le16(off);
+	packet->remaining = cpu_to_le16(rem);
+	packet->length = cpu_to_le16(len);
+
+	crc = applespi_crc16(0, (u8 *)packet, sizeof(*packet) - 2);
+	packet->crc16 = cpu_to_le16(crc);
+}
+
+unsigned int applespi_bench_make_keyboard_packet(u8 *buf, unsigned int seq)
+{
+	struct spi_packet *packet = (struct spi_packet *)buf;
+	struct message *message = (struct message *)packet->data;
+	unsigned int msg_len = MSG_HEADER_SIZE + sizeof(message->keyboard);
+	u16 crc;
+
+	memset(buf, 0, APPLESPI_PACKET_SIZE);
 
-		if (rem > 0)
-			return;
+	message->type = cpu_to_le16(0x0110);
+	message->length = cpu_to_le16(sizeof(message->keyboard) - 2);
 
-		message = (struct message *)applespi->msg_buf;
-		msg_len = applespi->saved_msg_len;
-	} else {
-		message = (struct message *)&packet->data;
-		msg_len = len;
-	}
+	/* one letter key down, cycling so consecutive events differ */
+	message->keyboard.keys_pressed[0] = 0x04 + seq % 26;
 
-	/* got complete message - verify */
-	if (!applespi_verify_crc(applespi, (u8 *)message, msg_len))
-		goto msg_complete;
+	crc = applespi_crc16(0, (u8 *)message, msg_len - 2);
+	put_unaligned_le16(crc, (u8 *)message + msg_len - 2);
 
-	if (le16_to_cpu(message->length) != msg_len - MSG_HEADER_SIZE - 2) {
-		dev_warn_ratelimited(&applespi->spi->dev,
-				     "Received corrupted packet (invalid message length %u - expected %u)\n",
-				     le16_to_cpu(message->length),
-				     msg_len - MSG_HEADER_SIZE - 2);
-		goto msg_complete;
-	}
+	applespi_bench_finish_packet(packet, PACKET_DEV_KEYB, 0, 0, msg_len);
 
-	/* handle message */
-	if (packet->flags == PACKET_TYPE_READ &&
-	    packet->device == PACKET_DEV_KEYB) {
-		applespi_handle_keyboard_event(applespi, &message->keyboard);
+	return 1;
+}
+EXPORT_SYMBOL_GPL(applespi_bench_make_keyboard_packet);
 
-	} else if (packet->flags == PACKET_TYPE_READ &&
-		   packet->device == PACKET_DEV_TPAD) {
-		struct touchpad_protocol *tp;
-		size_t tp_len;
+unsigned int applespi_bench_make_touchpad_packets(u8 *buf,
+						  unsigned int nfingers)
+{
+	struct touchpad_protocol *tp;
+	struct message *message;
+	struct tp_finger *f;
+	unsigned int msg_len;
+	unsigned int npkts;
+	unsigned int off;
+	unsigned int len;
+	unsigned int i;
+	u8 *msg;
+	u16 crc;
 
-		tp = &message->touchpad;
-		tp_len = struct_size(tp, fingers, tp->number_of_fingers);
+	if (nfingers > MAX_FINGERS)
+		nfingers = MAX_FINGERS;
 
-		if (le16_to_cpu(message->length) + 2 != tp_len) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Received corrupted packet (invalid message length %u - num-fingers %u, tp-len %zu)\n",
-					     le16_to_cpu(message->length),
-					     tp->number_of_fingers, tp_len);
-			goto msg_complete;
-		}
+	msg_len = MSG_HEADER_SIZE + sizeof(*tp) +
+		  nfingers * sizeof(struct tp_finger);
 
-		if (tp->number_of_fingers > MAX_FINGERS) {
-			dev_warn_ratelimited(&applespi->spi->dev,
-					     "Number of reported fingers (%u) exceeds max (%u))\n",
-					     tp->number_of_fingers,
-					     MAX_FINGERS);
-			tp->number_of_fingers = MAX_FINGERS;
-		}
+	msg = kzalloc(msg_len, GFP_KERNEL);
+	if (!msg)
+		return 0;
 
-		report_tp_state(applespi, tp);
+	message = (struct message *)msg;
+	message->type = cpu_to_le16(0x0210);
+	message->length = cpu_to_le16(msg_len - MSG_HEADER_SIZE - 2);
+
+	tp = &message->touchpad;
+	tp->number_of_fingers = nfingers;
+
+	for (i = 0; i < nfingers; i++) {
+		f = &tp->fingers[i];
+		f->origin = cpu_to_le16(i + 1);
+		f->abs_x = cpu_to_le16(1000 + 400 * i);
+		f->abs_y = cpu_to_le16(2000 + 100 * i);
+		f->tool_major = cpu_to_le16(300);
+		f->tool_minor = cpu_to_le16(250);
+		f->orientation = cpu_to_le16(16384);
+		f->touch_major = cpu_to_le16(300);
+		f->touch_minor = cpu_to_le16(250);
+		f->pressure = cpu_to_le16(100);
+	}
 
-	} else if (packet->flags == PACKET_TYPE_WRITE) {
-		applespi_handle_cmd_response(applespi, packet, message);
+	/* the last finger's crc16 field doubles as the message crc */
+	crc = applespi_crc16(0, msg, msg_len - 2);
+	put_unaligned_le16(crc, msg + msg_len - 2);
+
+	/* split into packets the same way the device does */
+	npkts = 0;
+	off = 0;
+	while (off < msg_len) {
+		struct spi_packet *packet = (struct spi_packet *)
+				(buf + npkts * APPLESPI_PACKET_SIZE);
+
+		len = min_t(unsigned int, msg_len - off, sizeof(packet->data));
+
+		memset(packet, 0, APPLESPI_PACKET_SIZE);
+		memcpy(packet->data, msg + off, len);
+		applespi_bench_finish_packet(packet, PACKET_DEV_TPAD, off,
+					     msg_len - off - len, len);
+
+		off += len;
+		npkts++;
 	}
 
-msg_complete:
-	applespi->saved_msg_len = 0;
+	kfree(msg);
 
-	applespi_msg_complete(applespi, packet->flags == PACKET_TYPE_WRITE,
-			      true);
+	return npkts;
 }
+EXPORT_SYMBOL_GPL(applespi_bench_make_touchpad_packets);
+
+#endif /* APPLESPI_BENCH */
 
+/*
+ * Runs in the spi controller's message pump; keep this minimal so the
+ * controller can turn around the next transfer as quickly as possible. All
+ * crc checking, reassembly and input reporting is done by the parse thread.
+ */
 static void applespi_async_read_complete(void *context)
 {
 	struct applespi_data *applespi = context;
+	unsigned int head = applespi->rx_ring_head;
+	unsigned int next = (head + 1) % applespi->rx_ring_len;
+	struct spi_packet *packet;
 
 	if (applespi->rd_m.status < 0) {
 		dev_warn(&applespi->spi->dev, "Error reading from device: %d\n",
@@ -1751,13 +3113,190 @@ static void applespi_async_read_complete(void *context)
 		 * never occur, so clearing both flags to avoid deadlock.
 		 */
 		applespi_msg_complete(applespi, true, true);
+
+		goto finish_gpe;
+	}
+
+	packet = (struct spi_packet *)applespi->rd_t.rx_buf;
+
+	applespi->stats.bytes_read += APPLESPI_PACKET_SIZE;
+
+	if (!packet->flags && !packet->device && !packet->length) {
+		/* polled with nothing pending - don't wake the parser */
+		applespi->poll_empty_reads++;
+		applespi->stats.empty_reads++;
+	} else if (next == READ_ONCE(applespi->rx_ring_tail)) {
+		/*
+		 * The parse thread has fallen behind; drop this packet (i.e.
+		 * reuse its buffer for the next read) rather than stalling the
+		 * spi bus. Any half-assembled message is discarded by the
+		 * parser when the following packet's offset doesn't line up.
+		 */
+		dev_warn_ratelimited(&applespi->spi->dev,
+				     "RX ring full - dropping packet\n");
+		applespi->poll_empty_reads = 0;
+		applespi->stats.dropped_pkts++;
 	} else {
-		applespi_got_data(applespi);
+		applespi->poll_empty_reads = 0;
+		applespi->rx_irq_ts[head] = applespi->last_irq_ts;
+		applespi->rx_compl_ts[head] = ktime_get();
+		applespi->rd_t.rx_buf = applespi->rx_buffers[next];
+		smp_store_release(&applespi->rx_ring_head, next);
+		wake_up(&applespi->parse_wait);
+	}
+
+	/*
+	 * The spi exchange is over, so the read is no longer in flight - even
+	 * though the packet may still be waiting in the ring for the parse
+	 * thread. Clearing read_active anywhere later (e.g. from the parser)
+	 * would race with the next read that the gpe or poll timer may queue
+	 * as soon as the gpe is finished below, and could let the drain paths
+	 * proceed with a transfer still outstanding.
+	 */
+	applespi_msg_complete(applespi, false, true);
+
+	/*
+	 * While packets keep arriving, keep the GPE unfinished (disabled) and
+	 * keep reading from the timer instead, saving the ACPI round-trip per
+	 * packet.
+	 */
+	if (READ_ONCE(applespi->poll_enable) && !applespi->drain &&
+	    applespi->poll_empty_reads < READ_ONCE(applespi->poll_empty_limit)) {
+		applespi->polling = true;
+		hrtimer_start(&applespi->poll_timer,
+			      ns_to_ktime((u64)READ_ONCE(applespi->poll_interval_us) *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+		return;
 	}
 
+finish_gpe:
+	applespi->polling = false;
 	acpi_finish_gpe(NULL, applespi->gpe);
 }
 
+static enum hrtimer_restart applespi_poll_timer_fn(struct hrtimer *timer)
+{
+	struct applespi_data *applespi = container_of(timer,
+						      struct applespi_data,
+						      poll_timer);
+	unsigned long flags;
+	int sts = -ESHUTDOWN;
+
+	applespi->last_irq_ts = ktime_get();
+
+	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
+
+	if (!applespi->suspended && !applespi->drain) {
+		sts = applespi_async(applespi, &applespi->rd_m,
+				     applespi_async_read_complete);
+		if (sts)
+			dev_warn_ratelimited(&applespi->spi->dev,
+					     "Error queueing polled read to device: %d\n",
+					     sts);
+		else
+			applespi->read_active = true;
+	}
+
+	if (sts) {
+		/*
+		 * Going down (or a queueing error) - just drop out of poll
+		 * mode; the teardown/resume paths own the GPE state.
+		 */
+		applespi->polling = false;
+	}
+
+	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void applespi_poll_stop(struct applespi_data *applespi)
+{
+	/*
+	 * Called after the GPE has been disabled and all reads have drained,
+	 * so neither the timer nor the read completion can re-arm each other
+	 * anymore. The unfinished GPE is taken care of by acpi_enable_gpe()
+	 * on resume.
+	 */
+	hrtimer_cancel(&applespi->poll_timer);
+	applespi->polling = false;
+	applespi->poll_empty_reads = 0;
+}
+
+static int applespi_parse_thread(void *data)
+{
+	struct applespi_data *applespi = data;
+	unsigned int cursor = applespi->rx_ring_tail;
+	unsigned int head;
+
+	/*
+	 * @cursor is the consume position and always advances past parsed
+	 * packets; the published rx_ring_tail is only the reclaim boundary
+	 * for the read completion and may lag behind it (see below), so it
+	 * must never be used as the resume position.
+	 */
+	while (!kthread_should_stop()) {
+		if (READ_ONCE(applespi->inject_pending))
+			applespi_run_injection(applespi);
+
+		head = smp_load_acquire(&applespi->rx_ring_head);
+
+		if (head == cursor) {
+			wait_event_interruptible(applespi->parse_wait,
+				kthread_should_stop() ||
+				READ_ONCE(applespi->inject_pending) ||
+				smp_load_acquire(&applespi->rx_ring_head) !=
+							cursor);
+			continue;
+		}
+
+		while (cursor != head) {
+			unsigned int held;
+
+			/*
+			 * Returns the number of just-consumed buffers still
+			 * holding fragments of an incomplete message; those
+			 * must not be released back to the read completion
+			 * yet, so the published tail lags behind by that much.
+			 */
+			applespi->cur_irq_ts = applespi->rx_irq_ts[cursor];
+			applespi->cur_compl_ts = applespi->rx_compl_ts[cursor];
+
+			held = applespi_got_data(applespi,
+						 applespi->rx_buffers[cursor]);
+
+			cursor = (cursor + 1) % applespi->rx_ring_len;
+			smp_store_release(&applespi->rx_ring_tail,
+					  (cursor + applespi->rx_ring_len - held) %
+							applespi->rx_ring_len);
+		}
+	}
+
+	/* release anyone waiting on an injection we'll never run */
+	if (READ_ONCE(applespi->inject_pending)) {
+		WRITE_ONCE(applespi->inject_pending, false);
+		complete(&applespi->inject_done);
+	}
+
+	return 0;
+}
+
+static void applespi_set_parse_thread_prio(struct task_struct *task)
+{
+	/*
+	 * Input processing shouldn't have to compete with random fair-class
+	 * load, so run the parse thread at a (low) real-time priority.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	sched_set_fifo_low(task);
+#else
+	struct sched_param param = { .sched_priority = 1 };
+
+	sched_setscheduler(task, SCHED_FIFO, &param);
+#endif
+}
+
 static u32 applespi_notify(acpi_handle gpe_device, u32 gpe, void *context)
 {
 	struct applespi_data *applespi = context;
@@ -1766,6 +3305,9 @@ static u32 applespi_notify(acpi_handle gpe_device, u32 gpe, void *context)
 
 	trace_applespi_irq_received(ET_RD_IRQ, PT_READ);
 
+	applespi->stats.irqs++;
+	applespi->last_irq_ts = ktime_get();
+
 	spin_lock_irqsave(&applespi->cmd_msg_lock, flags);
 
 	if (!applespi->suspended) {
@@ -1820,6 +3362,10 @@ static void applespi_save_bl_level(struct applespi_data *applespi,
 	u16 efi_data;
 	int sts;
 
+	/* EFI writes are expensive - skip if the level is already saved */
+	if (level == applespi->saved_bl_level)
+		return;
+
 	/* Save keyboard backlight level */
 	efi_guid = EFI_BL_LEVEL_GUID;
 	efi_data = (u16)level;
@@ -1832,6 +3378,16 @@ static void applespi_save_bl_level(struct applespi_data *applespi,
 	if (sts)
 		dev_warn(&applespi->spi->dev,
 			 "Error saving backlight level to EFI vars: %d\n", sts);
+	else
+		applespi->saved_bl_level = level;
+}
+
+static void applespi_save_bl_level_work(struct work_struct *work)
+{
+	struct applespi_data *applespi =
+		container_of(work, struct applespi_data, bl_save_work.work);
+
+	applespi_save_bl_level(applespi, READ_ONCE(applespi->have_bl_level));
 }
 
 static void applespi_enable_early_event_tracing(struct device *dev)
@@ -1858,15 +3414,125 @@ static void applespi_enable_early_event_tracing(struct device *dev)
 	}
 }
 
+/*
+ * Set up everything that delivering keystrokes doesn't depend on - wakeup,
+ * the keyboard backlight (which starts with an EFI runtime-services call),
+ * and debugfs - off the probe path, so input goes live as early as possible.
+ * Nothing in here is allowed to fail the probe; the one fallible step (the
+ * LED class registration) only warned before, too.
+ */
+static void applespi_late_init_worker(struct work_struct *work)
+{
+	struct applespi_data *applespi =
+		container_of(work, struct applespi_data, late_init_work);
+	struct spi_device *spi = applespi->spi;
+	int sts;
+
+	/*
+	 * By default this device is not enabled for wakeup; but USB keyboards
+	 * generally are, so the expectation is that by default the keyboard
+	 * will wake the system.
+	 */
+	device_wakeup_enable(&spi->dev);
+
+	/* set up keyboard-backlight */
+	sts = applespi_get_saved_bl_level(applespi);
+	if (sts >= 0) {
+		applespi->saved_bl_level = sts;
+		applespi_set_bl_level(&applespi->backlight_info, sts);
+	}
+
+	applespi->backlight_info.name            = "spi::kbd_backlight";
+	applespi->backlight_info.default_trigger = "kbd-backlight";
+	applespi->backlight_info.brightness_set  = applespi_set_bl_level;
+
+	sts = devm_led_classdev_register(&spi->dev, &applespi->backlight_info);
+	if (sts)
+		dev_warn(&spi->dev,
+			 "Unable to register keyboard backlight class dev (%d)\n",
+			 sts);
+
+	/* set up debugfs entries for touchpad dimensions logging */
+	applespi->debugfs_root = debugfs_create_dir("applespi", NULL);
+
+	debugfs_create_bool("enable_tp_dim", 0600, applespi->debugfs_root,
+			    &applespi->debug_tp_dim);
+
+	debugfs_create_file("tp_dim", 0400, applespi->debugfs_root, applespi,
+			    &applespi_tp_dim_fops);
+
+	debugfs_create_u64("crc16_generic_bench_ns", 0444,
+			   applespi->debugfs_root, &applespi_crc16_bench_ns[0]);
+	debugfs_create_u64("crc16_sb8_bench_ns", 0444, applespi->debugfs_root,
+			   &applespi_crc16_bench_ns[1]);
+
+	/* hybrid interrupt/poll mode tunables */
+	debugfs_create_bool("poll_enable", 0600, applespi->debugfs_root,
+			    &applespi->poll_enable);
+	debugfs_create_u32("poll_interval_us", 0600, applespi->debugfs_root,
+			   &applespi->poll_interval_us);
+	debugfs_create_u32("poll_empty_limit", 0600, applespi->debugfs_root,
+			   &applespi->poll_empty_limit);
+
+	/*
+	 * Packet injection / replay harness: write raw spi_packet images
+	 * (256 bytes each) to "inject", then read "replay" to feed them
+	 * through the parsing pipeline "replay_count" times and get the
+	 * throughput stats.
+	 */
+	debugfs_create_file("inject", 0200, applespi->debugfs_root, applespi,
+			    &applespi_inject_fops);
+	debugfs_create_u32("replay_count", 0600, applespi->debugfs_root,
+			   &applespi->replay_count);
+	debugfs_create_file("replay", 0400, applespi->debugfs_root, applespi,
+			    &applespi_replay_fops);
+
+	/*
+	 * Raw binary packet capture: mmap "capture" (read-only) and poll the
+	 * header's head index; records are written once "capture_enable" is
+	 * set.
+	 */
+	debugfs_create_bool("capture_enable", 0600, applespi->debugfs_root,
+			    &applespi->capture_enable);
+	debugfs_create_file("capture", 0400, applespi->debugfs_root, applespi,
+			    &applespi_capture_fops);
+
+	/*
+	 * Raw touchpad frame stream: mmap "tp_frames" (read-only) and poll
+	 * the header's head index; one slot per touchpad message with the
+	 * unflattened tp_finger records and a timestamp.
+	 */
+	debugfs_create_bool("tp_frames_enable", 0600, applespi->debugfs_root,
+			    &applespi->tp_frames_enable);
+	debugfs_create_file("tp_frames", 0400, applespi->debugfs_root,
+			    applespi, &applespi_tp_frames_fops);
+
+	/* hardware-to-input latency histograms */
+	debugfs_create_file("latency_hist", 0400, applespi->debugfs_root,
+			    applespi, &applespi_lat_hist_fops);
+
+	/* traffic statistics */
+	debugfs_create_u64("first_key_latency_ns", 0444, applespi->debugfs_root,
+			   &applespi->first_key_latency_ns);
+
+	debugfs_create_file("stats", 0400, applespi->debugfs_root, applespi,
+			    &applespi_stats_fops);
+}
+
 static int applespi_probe(struct spi_device *spi)
 {
 	struct applespi_data *applespi;
 	acpi_handle spi_handle = ACPI_HANDLE(&spi->dev);
 	acpi_status acpi_sts;
 	unsigned long flags;
+	unsigned int balign, pkt_sz, arena_sz;
+	u8 *arena;
 	int sts, i;
 	unsigned long long gpe, usb_status;
 
+	if (!ktime_to_ns(applespi_start_ts))
+		applespi_start_ts = ktime_get();
+
 	applespi_enable_early_event_tracing(&spi->dev);
 
 	/* check if the USB interface is present and enabled already */
@@ -1887,21 +3553,45 @@ static int applespi_probe(struct spi_device *spi)
 	/* store the driver data */
 	spi_set_drvdata(spi, applespi);
 
-	/* create our buffers */
-	applespi->tx_buffer = devm_kmalloc(&spi->dev, APPLESPI_PACKET_SIZE,
-					   GFP_KERNEL);
-	applespi->tx_status = devm_kmalloc(&spi->dev, APPLESPI_STATUS_SIZE,
-					   GFP_KERNEL);
-	applespi->rx_buffer = devm_kmalloc(&spi->dev, APPLESPI_PACKET_SIZE,
-					   GFP_KERNEL);
-	applespi->msg_buf = devm_kmalloc_array(&spi->dev, MAX_PKTS_PER_MSG,
-					       APPLESPI_PACKET_SIZE,
-					       GFP_KERNEL);
-
-	if (!applespi->tx_buffer || !applespi->tx_status ||
-	    !applespi->rx_buffer || !applespi->msg_buf)
+	applespi->rx_ring_len = clamp(rx_ring_depth,
+				      (unsigned int)APPLESPI_RX_RING_MIN,
+				      (unsigned int)APPLESPI_RX_RING_MAX);
+
+	/*
+	 * Create our transfer buffers, all carved out of one arena with each
+	 * buffer starting on its own DMA cacheline. This keeps the buffers
+	 * DMA-safe (no buffer shares a cacheline with another one, or with
+	 * unrelated driver state that may be written while a transfer is in
+	 * flight) and lets the spi core map them without bouncing.
+	 */
+	balign = dma_get_cache_alignment();
+	pkt_sz = ALIGN(APPLESPI_PACKET_SIZE, balign);
+
+	arena_sz = (applespi->rx_ring_len + 1 + MAX_PKTS_PER_MSG) * pkt_sz +
+		   ALIGN(APPLESPI_STATUS_SIZE, balign) + balign - 1;
+
+	arena = devm_kmalloc(&spi->dev, arena_sz, GFP_KERNEL);
+	if (!arena)
 		return -ENOMEM;
 
+	arena = PTR_ALIGN(arena, balign);
+
+	applespi->tx_buffer = arena;
+	arena += pkt_sz;
+	applespi->tx_status = arena;
+	arena += ALIGN(APPLESPI_STATUS_SIZE, balign);
+
+	for (i = 0; i < applespi->rx_ring_len; i++) {
+		applespi->rx_buffers[i] = arena;
+		arena += pkt_sz;
+	}
+
+	/* not involved in transfers, but may as well live in the arena too */
+	applespi->msg_buf = arena;
+
+	/* set up the crc tables */
+	applespi_crc16_init(applespi);
+
 	/* set up our spi messages */
 	applespi_setup_read_txfrs(applespi);
 	applespi_setup_write_txfrs(applespi);
@@ -1978,6 +3668,33 @@ static int applespi_probe(struct spi_device *spi)
 		return -ENODEV;
 	}
 
+	INIT_DELAYED_WORK(&applespi->bl_save_work, applespi_save_bl_level_work);
+	applespi->saved_bl_level = UINT_MAX;
+	INIT_WORK(&applespi->late_init_work, applespi_late_init_worker);
+
+	/* set up the packet injection/replay harness */
+	mutex_init(&applespi->inject_lock);
+	init_completion(&applespi->inject_done);
+	applespi->replay_count = 1;
+
+	/* set up hybrid interrupt/poll mode (off unless enabled in debugfs) */
+	hrtimer_init(&applespi->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	applespi->poll_timer.function = applespi_poll_timer_fn;
+	applespi->poll_interval_us = 1000;
+	applespi->poll_empty_limit = 16;
+
+	/* start the packet parsing pipeline */
+	applespi->parse_task = kthread_run(applespi_parse_thread, applespi,
+					   "applespi");
+	if (IS_ERR(applespi->parse_task)) {
+		sts = PTR_ERR(applespi->parse_task);
+		dev_err(&applespi->spi->dev,
+			"Failed to create parse thread (%d)\n", sts);
+		return sts;
+	}
+
+	applespi_set_parse_thread_prio(applespi->parse_task);
+
 	/*
 	 * The applespi device doesn't send interrupts normally (as is described
 	 * in its DSDT), but rather seems to use ACPI GPEs.
@@ -1987,7 +3704,8 @@ static int applespi_probe(struct spi_device *spi)
 		dev_err(&applespi->spi->dev,
 			"Failed to obtain GPE for SPI slave device: %s\n",
 			acpi_format_exception(acpi_sts));
-		return -ENODEV;
+		sts = -ENODEV;
+		goto stop_parse_thread;
 	}
 	applespi->gpe = (int)gpe;
 
@@ -1998,7 +3716,8 @@ static int applespi_probe(struct spi_device *spi)
 		dev_err(&applespi->spi->dev,
 			"Failed to install GPE handler for GPE %d: %s\n",
 			applespi->gpe, acpi_format_exception(acpi_sts));
-		return -ENODEV;
+		sts = -ENODEV;
+		goto stop_parse_thread;
 	}
 
 	applespi->suspended = false;
@@ -2009,58 +3728,43 @@ static int applespi_probe(struct spi_device *spi)
 			"Failed to enable GPE handler for GPE %d: %s\n",
 			applespi->gpe, acpi_format_exception(acpi_sts));
 		acpi_remove_gpe_handler(NULL, applespi->gpe, applespi_notify);
-		return -ENODEV;
+		sts = -ENODEV;
+		goto stop_parse_thread;
 	}
 
-	/* trigger touchpad setup */
-	applespi_init(applespi, false);
+	/*
+	 * Trigger touchpad setup. The touchpad model can't change across a
+	 * rebind, so after the first probe the info round-trip (and the wait
+	 * for its response) is skipped.
+	 */
+	if (applespi_have_tp_info)
+		applespi->rcvd_tp_info = applespi_saved_tp_info;
+
+	applespi_init(applespi, applespi_have_tp_info);
+
+	if (!applespi_have_tp_info) {
+		sts = wait_event_timeout(applespi->tp_info_complete,
+					 applespi->rcvd_tp_info.model_no,
+					 msecs_to_jiffies(3000));
+		if (!sts) {
+			dev_err(&applespi->spi->dev,
+				"Timed out waiting for device info\n");
+			sts = -ETIMEDOUT;
+			goto cancel_spi;
+		}
 
-	/* set up the touchpad as a separate input device */
-	sts = wait_event_timeout(applespi->tp_info_complete,
-				 applespi->rcvd_tp_info.model_no,
-				 msecs_to_jiffies(3000));
-	if (!sts) {
-		dev_err(&applespi->spi->dev,
-			"Timed out waiting for device info\n");
-		sts = -ETIMEDOUT;
-		goto cancel_spi;
+		applespi_saved_tp_info = applespi->rcvd_tp_info;
+		applespi_have_tp_info = true;
 	}
 
+	/* set up the touchpad as a separate input device */
 	sts = applespi_register_touchpad_device(applespi,
 						&applespi->rcvd_tp_info);
 	if (sts)
 		goto cancel_spi;
 
-	/*
-	 * By default this device is not enabled for wakeup; but USB keyboards
-	 * generally are, so the expectation is that by default the keyboard
-	 * will wake the system.
-	 */
-	device_wakeup_enable(&spi->dev);
-
-	/* set up keyboard-backlight */
-	sts = applespi_get_saved_bl_level(applespi);
-	if (sts >= 0)
-		applespi_set_bl_level(&applespi->backlight_info, sts);
-
-	applespi->backlight_info.name            = "spi::kbd_backlight";
-	applespi->backlight_info.default_trigger = "kbd-backlight";
-	applespi->backlight_info.brightness_set  = applespi_set_bl_level;
-
-	sts = devm_led_classdev_register(&spi->dev, &applespi->backlight_info);
-	if (sts)
-		dev_warn(&applespi->spi->dev,
-			 "Unable to register keyboard backlight class dev (%d)\n",
-			 sts);
-
-	/* set up debugfs entries for touchpad dimensions logging */
-	applespi->debugfs_root = debugfs_create_dir("applespi", NULL);
-
-	debugfs_create_bool("enable_tp_dim", 0600, applespi->debugfs_root,
-			    &applespi->debug_tp_dim);
-
-	debugfs_create_file("tp_dim", 0400, applespi->debugfs_root, applespi,
-			    &applespi_tp_dim_fops);
+	/* input is live; everything else can finish asynchronously */
+	schedule_work(&applespi->late_init_work);
 
 	return 0;
 
@@ -2075,6 +3779,11 @@ cancel_spi:
 			    applespi->cmd_msg_lock);
 	spin_unlock_irqrestore(&applespi->cmd_msg_lock, flags);
 
+	hrtimer_cancel(&applespi->poll_timer);
+
+stop_parse_thread:
+	kthread_stop(applespi->parse_task);
+
 	return sts;
 }
 
@@ -2113,6 +3822,9 @@ static int applespi_remove(struct spi_device *spi)
 {
 	struct applespi_data *applespi = spi_get_drvdata(spi);
 
+	cancel_work_sync(&applespi->late_init_work);
+	cancel_delayed_work_sync(&applespi->bl_save_work);
+
 	applespi_drain_writes(applespi);
 
 	acpi_disable_gpe(NULL, applespi->gpe);
@@ -2120,9 +3832,16 @@ static int applespi_remove(struct spi_device *spi)
 	device_wakeup_disable(&spi->dev);
 
 	applespi_drain_reads(applespi);
+	applespi_poll_stop(applespi);
+
+	kthread_stop(applespi->parse_task);
 
 	debugfs_remove_recursive(applespi->debugfs_root);
 
+	kfree(applespi->inject_buf);
+	vfree(applespi->capture_buf);
+	vfree(applespi->tp_frames_buf);
+
 	return 0;
 }
 
@@ -2130,6 +3849,7 @@ static void applespi_shutdown(struct spi_device *spi)
 {
 	struct applespi_data *applespi = spi_get_drvdata(spi);
 
+	cancel_delayed_work_sync(&applespi->bl_save_work);
 	applespi_save_bl_level(applespi, applespi->have_bl_level);
 }
 
@@ -2138,6 +3858,7 @@ static int applespi_poweroff_late(struct device *dev)
 	struct spi_device *spi = to_spi_device(dev);
 	struct applespi_data *applespi = spi_get_drvdata(spi);
 
+	cancel_delayed_work_sync(&applespi->bl_save_work);
 	applespi_save_bl_level(applespi, applespi->have_bl_level);
 
 	return 0;
@@ -2150,6 +3871,10 @@ static int __maybe_unused applespi_suspend(struct device *dev)
 	acpi_status acpi_sts;
 	int sts;
 
+	/* make sure the backlight level is persisted before we go down */
+	cancel_delayed_work_sync(&applespi->bl_save_work);
+	applespi_save_bl_level(applespi, applespi->have_bl_level);
+
 	/* turn off caps-lock - it'll stay on otherwise */
 	sts = applespi_set_capsl_led(applespi, false);
 	if (sts)
@@ -2166,6 +3891,7 @@ static int __maybe_unused applespi_suspend(struct device *dev)
 			applespi->gpe, acpi_format_exception(acpi_sts));
 
 	applespi_drain_reads(applespi);
+	applespi_poll_stop(applespi);
 
 	return 0;
 }
@@ -2201,7 +3927,14 @@ static int __maybe_unused applespi_resume(struct device *dev)
 			"Failed to re-enable GPE handler for GPE %d: %s\n",
 			applespi->gpe, acpi_format_exception(acpi_sts));
 
-	/* switch the touchpad into multitouch mode */
+	/*
+	 * Switch the touchpad into multitouch mode and restore the backlight
+	 * and caps-lock leds. All of these are queued up front so that the
+	 * commands go out back-to-back as their predecessors complete,
+	 * without intermediate waits.
+	 */
+	set_bit(CMD_CL_LED, &applespi->cmd_pending);
+	set_bit(CMD_BL_LEVEL, &applespi->cmd_pending);
 	applespi_init(applespi, true);
 
 	return 0;
@@ -2448,10 +4181,12 @@ static int appleacpi_spi_master_added(struct device *dev,
 
 	/*
 	 * mutexes are held here, preventing unregistering of physical devices,
-	 * so need to do the actual registration in a worker.
+	 * so need to do the actual registration in a worker. No delay is
+	 * needed though - the worker itself backs off if the master's queue
+	 * isn't running yet.
 	 */
 	info->spi_master = spi_master_get(spi_master);
-	schedule_delayed_work(&info->work, usecs_to_jiffies(100));
+	schedule_delayed_work(&info->work, 0);
 
 	return 0;
 }
@@ -2514,6 +4249,9 @@ static int appleacpi_probe(struct acpi_device *adev)
 		 acpi_device_hid(adev), acpi_device_bid(adev),
 		 acpi_device_adr(adev), acpi_device_uid(adev));
 
+	if (!ktime_to_ns(applespi_start_ts))
+		applespi_start_ts = ktime_get();
+
 	ret = spi_register_driver(&applespi_driver);
 	if (ret) {
 		pr_err("Failed to register spi-driver: %d\n", ret);
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Micro-benchmarks for the applespi / apple-ib hot paths.
+ *
+ * Built only by "make bench" (which defines APPLESPI_BENCH so the drivers
+ * compile in their bench hooks - see applespi_bench.h). The suite runs the
+ * real driver code over synthetic packet corpora and reports ns/op for each
+ * hot path via kunit_info(), so performance changes can land with
+ * before/after numbers from any machine - no Apple hardware needed. Each
+ * case also sanity-checks the results so a correctness regression fails the
+ * suite rather than just skewing the numbers.
+ *
+ * Load the module (or boot with kunit.filter_glob=applespi_bench under
+ * CONFIG_KUNIT) and read the results from dmesg / the kunit debugfs log.
+ */
+
+#include <linux/input.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <kunit/test.h>
+
+#include "applespi_bench.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+#error "applespi_bench requires a KUnit-enabled kernel (>= 5.5)"
+#endif
+
+#define BENCH_ITERS		100000
+
+#define BENCH_CORPUS_SIZE	(APPLESPI_BENCH_MAX_PKTS_PER_MSG * \
+				 APPLESPI_BENCH_PACKET_SIZE)
+
+static u64 bench_ns_per_op(u64 elapsed_ns, u64 ops)
+{
+	return div64_u64(elapsed_ns, ops);
+}
+
+static void applespi_bench_crc16_case(struct kunit *test)
+{
+	u8 *buf;
+	u64 start;
+	u64 generic_ns;
+	u64 sb8_ns;
+	u16 crc = 0;
+	int i;
+
+	buf = kunit_kmalloc(test, APPLESPI_BENCH_PACKET_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	for (i = 0; i < APPLESPI_BENCH_PACKET_SIZE; i++)
+		buf[i] = i * 7 + 3;
+
+	/* both implementations must agree before their times mean anything */
+	KUNIT_ASSERT_EQ(test,
+			applespi_bench_crc16(0, buf,
+					     APPLESPI_BENCH_PACKET_SIZE, false),
+			applespi_bench_crc16(0, buf,
+					     APPLESPI_BENCH_PACKET_SIZE, true));
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERS; i++)
+		crc = applespi_bench_crc16(crc, buf,
+					   APPLESPI_BENCH_PACKET_SIZE, false);
+	generic_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERS; i++)
+		crc = applespi_bench_crc16(crc, buf,
+					   APPLESPI_BENCH_PACKET_SIZE, true);
+	sb8_ns = ktime_get_ns() - start;
+
+	/* crc dependency between iterations keeps the loops from being elided */
+	kunit_info(test, "crc16 generic: %llu ns/op, slice-by-8: %llu ns/op (%u-byte packet, crc %#x)\n",
+		   bench_ns_per_op(generic_ns, BENCH_ITERS),
+		   bench_ns_per_op(sb8_ns, BENCH_ITERS),
+		   APPLESPI_BENCH_PACKET_SIZE, crc);
+}
+
+static void applespi_bench_parse_one(struct kunit *test,
+				     struct applespi_data *applespi,
+				     u8 *pkts, unsigned int npkts,
+				     const char *what)
+{
+	unsigned int held = 0;
+	u64 start;
+	u64 elapsed;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERS; i++)
+		held |= applespi_bench_parse(applespi, pkts, npkts);
+	elapsed = ktime_get_ns() - start;
+
+	/* a corrupt corpus would silently bench the error path instead */
+	KUNIT_EXPECT_EQ(test, 0u, held);
+	KUNIT_EXPECT_EQ(test, 0ull, applespi_bench_error_count(applespi));
+
+	kunit_info(test, "%s: %llu ns/op (%u packet(s) per message)\n", what,
+		   bench_ns_per_op(elapsed, BENCH_ITERS), npkts);
+}
+
+static void applespi_bench_parse_case(struct kunit *test)
+{
+	struct applespi_data *applespi;
+	unsigned int npkts;
+	u8 *pkts;
+
+	applespi = applespi_bench_alloc();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, applespi);
+
+	pkts = kunit_kmalloc(test, BENCH_CORPUS_SIZE, GFP_KERNEL);
+	if (!pkts) {
+		applespi_bench_free(applespi);
+		KUNIT_FAIL(test, "corpus allocation failed");
+		return;
+	}
+
+	npkts = applespi_bench_make_keyboard_packet(pkts, 0);
+	KUNIT_EXPECT_EQ(test, 1u, npkts);
+	applespi_bench_parse_one(test, applespi, pkts, npkts,
+				 "keyboard event parse");
+
+	npkts = applespi_bench_make_touchpad_packets(pkts, 3);
+	KUNIT_EXPECT_EQ(test, 1u, npkts);
+	applespi_bench_parse_one(test, applespi, pkts, npkts,
+				 "touchpad parse, 3 fingers");
+
+	/* 11 fingers don't fit in one packet - exercises the reassembly */
+	npkts = applespi_bench_make_touchpad_packets(pkts, 11);
+	KUNIT_EXPECT_EQ(test, 2u, npkts);
+	applespi_bench_parse_one(test, applespi, pkts, npkts,
+				 "touchpad reassembly, 11 fingers");
+
+	applespi_bench_free(applespi);
+}
+
+static void applespi_bench_scancode_case(struct kunit *test)
+{
+	unsigned int key = 0;
+	u64 start;
+	u64 elapsed;
+	int i;
+
+	KUNIT_EXPECT_EQ(test, (unsigned int)KEY_A,
+			applespi_bench_code_to_key(0x04, 0));
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERS; i++)
+		key += applespi_bench_code_to_key(0x04 + i % 26, i & 1);
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "scancode translation: %llu ns/op (sum %u)\n",
+		   bench_ns_per_op(elapsed, BENCH_ITERS), key);
+}
+
+static void applespi_bench_tb_slot_case(struct kunit *test)
+{
+	u64 start;
+	u64 elapsed;
+	int slot = 0;
+	int i;
+
+	KUNIT_EXPECT_EQ(test, 0, appletb_bench_key_to_slot(KEY_ESC));
+	KUNIT_EXPECT_EQ(test, 1, appletb_bench_key_to_slot(KEY_F1));
+	KUNIT_EXPECT_EQ(test, 12, appletb_bench_key_to_slot(KEY_F12));
+	KUNIT_EXPECT_EQ(test, -1, appletb_bench_key_to_slot(KEY_A));
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERS; i++)
+		slot += appletb_bench_key_to_slot(KEY_F1 + i % 10);
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "touch bar key-to-slot: %llu ns/op (sum %d)\n",
+		   bench_ns_per_op(elapsed, BENCH_ITERS), slot);
+}
+
+static void applespi_bench_als_sens_case(struct kunit *test)
+{
+	u64 start;
+	u64 elapsed;
+	int sens = 1;
+	int i;
+
+	KUNIT_EXPECT_EQ(test, 1, appleals_bench_compute_sensitivity(0, 1));
+	KUNIT_EXPECT_EQ(test, 9, appleals_bench_compute_sensitivity(100, 9));
+	KUNIT_EXPECT_EQ(test, 729,
+			appleals_bench_compute_sensitivity(20000, 1));
+
+	start = ktime_get_ns();
+	for (i = 0; i < BENCH_ITERS; i++)
+		sens = appleals_bench_compute_sensitivity(i % 10000, sens);
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "als sensitivity lookup: %llu ns/op (last %d)\n",
+		   bench_ns_per_op(elapsed, BENCH_ITERS), sens);
+}
+
+static struct kunit_case applespi_bench_cases[] = {
+	KUNIT_CASE(applespi_bench_crc16_case),
+	KUNIT_CASE(applespi_bench_parse_case),
+	KUNIT_CASE(applespi_bench_scancode_case),
+	KUNIT_CASE(applespi_bench_tb_slot_case),
+	KUNIT_CASE(applespi_bench_als_sens_case),
+	{}
+};
+
+static struct kunit_suite applespi_bench_suite = {
+	.name = "applespi_bench",
+	.test_cases = applespi_bench_cases,
+};
+
+kunit_test_suite(applespi_bench_suite);
+
+MODULE_DESCRIPTION("MacBook (Pro) SPI/iBridge driver hot-path benchmarks");
+MODULE_LICENSE("GPL v2");
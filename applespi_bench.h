@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Hot-path benchmark hooks for the applespi / apple-ib drivers.
+ *
+ * These entry points are only compiled in when APPLESPI_BENCH is defined
+ * (i.e. by "make bench") and exist solely for the applespi_bench module;
+ * they are never part of a regular build. They run the real driver code
+ * over synthetic, caller-built packets, so the benchmarks work on any
+ * machine, without the actual hardware.
+ */
+
+#ifndef __APPLESPI_BENCH_H
+#define __APPLESPI_BENCH_H
+
+#include <linux/types.h>
+
+/* must match APPLESPI_PACKET_SIZE / MAX_PKTS_PER_MSG in applespi.c */
+#define APPLESPI_BENCH_PACKET_SIZE	256
+#define APPLESPI_BENCH_MAX_PKTS_PER_MSG	2
+
+struct applespi_data;
+
+/* applespi.ko */
+struct applespi_data *applespi_bench_alloc(void);
+void applespi_bench_free(struct applespi_data *applespi);
+unsigned int applespi_bench_parse(struct applespi_data *applespi, u8 *pkts,
+				  unsigned int npkts);
+u64 applespi_bench_error_count(struct applespi_data *applespi);
+unsigned int applespi_bench_make_keyboard_packet(u8 *buf, unsigned int seq);
+unsigned int applespi_bench_make_touchpad_packets(u8 *buf,
+						  unsigned int nfingers);
+u16 applespi_bench_crc16(u16 crc, const u8 *buffer, size_t len, bool sb8);
+unsigned int applespi_bench_code_to_key(u8 code, int fn_pressed);
+
+/* apple-ib-tb.ko */
+int appletb_bench_key_to_slot(unsigned int code);
+
+/* apple-ib-als.ko */
+int appleals_bench_compute_sensitivity(int cur_illum, int cur_sens);
+
+#endif